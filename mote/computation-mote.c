@@ -25,9 +25,15 @@ uint8_t info_from_parent = 0;
 // not so memory efficient but easy implementation. computation is done for the motes contained
 computed_mote_t computed_motes[MAX_NB_COMPUTED]; 
 
+// OPEN messages sent by this mote that are waiting to be retried after a route miss
+pending_OPEN_t pending_OPENs[MAX_PENDING_OPEN];
+
 // Trickle timer for the periodic messages
 trickle_timer_t t_timer;
 
+// Pending DIO answer to received DIS messages
+DIO_response_t DIO_response;
+
 // Broadcast connection
 static struct broadcast_conn broadcast;
 
@@ -52,6 +58,12 @@ struct ctimer parent_timer;
 // Callback timer to delete unresponsive children
 struct ctimer children_timer;
 
+// Callback timer to report the statistics
+struct ctimer stats_timer;
+
+// Callback timer to forget the subtree if the mote doesn't re-attach quickly
+struct ctimer repair_timer;
+
 
 /**
  * Callback function that will send the appropriate message when ctimer has expired.
@@ -109,20 +121,47 @@ void stop_timers() {
 }
 
 /**
- * Callback function that will detach from the DODAG if the parent is lost.
+ * Callback function that will forget the subtree of the mote if it is still detached.
+ */
+void repair_callback(void *ptr) {
+	flush_routes(&mote);
+}
+
+void parent_callback(void *ptr);
+
+/**
+ * Repairs the route towards the root after the parent has been lost.
+ * Switches to an alternate parent if there is one, and re-announces the subtree in one DAO.
+ * Otherwise, poisons the subtree with one DIO and detaches, keeping the subtree for REPAIR_HOLD seconds.
+ */
+void repair() {
+	if (local_repair(&mote) == PARENT_CHANGED) {
+		send_DIO(&broadcast, &mote);
+		send_DAO_subtree(&runicast, &mote);
+		reset_timers();
+		ctimer_set(&parent_timer, CLOCK_SECOND*TIMEOUT_PARENT,
+			parent_callback, NULL);
+	} else {
+		// DIO with infinite rank, so that the children look for another parent at once
+		send_DIO(&broadcast, &mote);
+		stop_timers();
+		ctimer_set(&repair_timer, CLOCK_SECOND*REPAIR_HOLD,
+			repair_callback, NULL);
+	}
+}
+
+/**
+ * Callback function that will repair the route if the parent is lost.
  */
 void parent_callback(void *ptr) {
 	// Reset the timer
 	ctimer_reset(&parent_timer);
 
-	// Detach from DODAG only if node was already in DODAG
+	// Repair only if node was already in DODAG
 	if (mote.in_dodag) {
-		// Detach from DODAG
-		detach(&mote);
-		// Reset sending timers
-		stop_timers();
+		repair();
 	}
-	
+
 }
 
 /**
@@ -137,6 +176,17 @@ void children_callback(void *ptr) {
 		reset_timers();
 	}
 
+	// Forget neighbours that haven't sent a DIO since a long time
+	neighbour_delete_timeout(mote.neighbours);
+
+}
+
+/**
+ * Callback function that will report the statistics of the mote.
+ */
+void stats_callback(void *ptr) {
+	ctimer_reset(&stats_timer);
+	report_stats(&mote);
 }
 
 
@@ -145,6 +195,18 @@ void children_callback(void *ptr) {
 ///  UNICAST CONNECTION  ///
 ////////////////////////////
 
+/**
+ * Sends an OPEN message to the sensor mote with address dst_addr.
+ * If there is no route towards it, asks for a fresh DAO and retries later.
+ */
+void open_valve(struct runicast_conn *conn, linkaddr_t dst_addr) {
+	printf("CM : OPEN message to mote %u.%u\n", dst_addr.u8[0], dst_addr.u8[1]);
+	if (send_OPEN(conn, dst_addr, &mote) == NO_ROUTE) {
+		send_DAO_REQ(&broadcast, dst_addr);
+		OPEN_route_miss(pending_OPENs, conn, dst_addr, &mote);
+	}
+}
+
 /**
  * Callback function, called when an unicast packet is received
  */
@@ -177,30 +239,106 @@ void runicast_recv(struct runicast_conn *conn, const linkaddr_t *from, uint8_t s
 			printf("Error adding to routing table\n");
 		}
 
+	} else if (type == DAO_AGG) {
+
+		// Aggregated DAO of a repaired subtree, add all its routes and forward to parent
+		DAO_AGG_message_t* message = (DAO_AGG_message_t*) packetbuf_dataptr();
+
+		int err = add_DAO_AGG_routes(mote.routing_table, message, from);
+		if (err == MAP_NEW || err == MAP_UPDATE) {
+
+			forward_DAO_AGG(conn, message, &mote);
+
+			if (err == MAP_NEW) { // New children were added to the routing table
+				reset_timers();
+			}
+
+		} else {
+			printf("Error adding to routing table\n");
+		}
+
 	} else if (type == DATA) {
 		// DATA packet, compute if mote is in list or if there is room
 		// Otherwise, forward towards root
 		DATA_message_t* message = (DATA_message_t*) packetbuf_dataptr();
-		int ret = add_and_check_valve(message->src_addr, computed_motes, message->data);
+		int ret = add_and_check_valve(message->src_addr, computed_motes, message->data, clock_seconds());
 		if (ret == OPEN_VALVE) {
 			// Send OPEN message to mote
-			printf("CM : OPEN message to mote %u.%u\n", message->src_addr.u8[0], message->src_addr.u8[1]);
-			send_OPEN(conn, message->src_addr, &mote);
+			open_valve(conn, message->src_addr);
 		} else if (ret == CANNOT_ADD_MOTE) {
 			// No room to add child, forward towards root
 			forward_DATA(conn, message, &mote);
 		}
 
+	} else if (type == DATA_BATCH) {
+		// DATA_BATCH packet, compute each reading, at the time it was read, if mote is in list or if there is room
+		// Otherwise, forward towards root
+		DATA_BATCH_message_t* message = (DATA_BATCH_message_t*) packetbuf_dataptr();
+		unsigned long now = clock_seconds();
+		int ret = CLOSE_VALVE;
+		uint8_t open = 0;
+		uint8_t i;
+		for (i = 0; i < message->nb && i < MAX_DATA_BATCH && ret != CANNOT_ADD_MOTE; i++) {
+			unsigned long age = (unsigned long) message->age + message->readings[i].delta;
+			ret = add_and_check_valve(message->src_addr, computed_motes, message->readings[i].data,
+				now > age ? now - age : 0);
+			if (ret == OPEN_VALVE) {
+				open = 1;
+			}
+		}
+		if (ret == CANNOT_ADD_MOTE) {
+			// No room to add child, forward towards root
+			forward_DATA_BATCH(conn, message, &mote);
+		} else if (open) {
+			// One OPEN message for the whole batch
+			open_valve(conn, message->src_addr);
+		}
+
 	} else if (type == OPEN) {
 		// OPEN packet, forward towards destination
 		OPEN_message_t* message = (OPEN_message_t*) packetbuf_dataptr();
 		linkaddr_t dst_addr = message->dst_addr;
 		if (linkaddr_cmp(&dst_addr, &(mote.addr))) {
 			printf("Computation mote, no valve to open.\n");
+		} else if (forward_OPEN(conn, message, &mote) == NO_ROUTE) {
+			// No route towards destination, ask for a fresh DAO and warn the origin
+			send_DAO_REQ(&broadcast, dst_addr);
+			send_ROUTE_MISS(conn, message->src_addr, dst_addr, OPEN, &mote);
+		}
+
+	} else if (type == CONFIG) {
+		// CONFIG packet, forward towards destination
+		CONFIG_message_t* message = (CONFIG_message_t*) packetbuf_dataptr();
+		linkaddr_t dst_addr = message->dst_addr;
+		if (linkaddr_cmp(&dst_addr, &(mote.addr))) {
+			printf("Computation mote, no valve to configure.\n");
+		} else if (forward_CONFIG(conn, message, &mote) == NO_ROUTE) {
+			// No route towards destination, ask for a fresh DAO and warn the origin
+			send_DAO_REQ(&broadcast, dst_addr);
+			send_ROUTE_MISS(conn, message->src_addr, dst_addr, CONFIG, &mote);
+		}
+
+	} else if (type == VALVE) {
+		// VALVE packet, the sensor mote opened its valve itself, forward towards root
+		VALVE_message_t* message = (VALVE_message_t*) packetbuf_dataptr();
+		forward_VALVE(conn, message, &mote);
+
+	} else if (type == ROUTE_MISS) {
+		// ROUTE_MISS packet, retry if this mote sent the OPEN message, forward towards origin otherwise
+		ROUTE_MISS_message_t* message = (ROUTE_MISS_message_t*) packetbuf_dataptr();
+		if (linkaddr_cmp(&(message->src_addr), &(mote.addr))) {
+			if (message->msg_type == OPEN) {
+				OPEN_route_miss(pending_OPENs, conn, message->dst_addr, &mote);
+			}
 		} else {
-			forward_OPEN(conn, message, &mote);
+			forward_ROUTE_MISS(conn, message, &mote);
 		}
 
+	} else if (type == DAO_REQ) {
+		// DAO_REQ packet sent along the path towards the requested mote
+		DAO_REQ_message_t* message = (DAO_REQ_message_t*) packetbuf_dataptr();
+		route_DAO_REQ(conn, &broadcast, message, &mote);
+
 	} else {
 		printf("Unknown runicast message received.\n");
 	}
@@ -235,27 +373,33 @@ const struct runicast_callbacks runicast_callbacks = {runicast_recv, runicast_se
  */
 void broadcast_recv(struct broadcast_conn *conn, const linkaddr_t *from) {
 
-	// Strength of the last received packet
+	// Strength and link quality of the last received packet
 	signed char rss = cc2420_last_rssi;
+	uint8_t lqi = cc2420_last_correlation;
 
 	uint8_t* data = (uint8_t*) packetbuf_dataptr();
 	uint8_t type = *data;
 
 	if (type == DIS) { // DIS message received
 		
-		// If the mote is already in a DODAG, send DIO packet
+		// If the mote is already in a DODAG, answer with a DIO after a random delay
 		if (mote.in_dodag) {
-			send_DIO(conn, &mote);
+			schedule_DIO_response(&DIO_response, conn, &mote);
 		}
 
 	} else if (type == DIO) { // DIO message received
 
 		DIO_message_t* message = (DIO_message_t*) packetbuf_dataptr();
-		if (linkaddr_cmp(from, &(mote.parent->addr))) { // DIO message received from parent
+		overheard_DIO(&DIO_response, message->rank);
+
+		// Smooth the link metrics of the sender, parent decisions use the smoothed rss and lqi
+		neighbour_t *neighbour = neighbour_update(mote.neighbours, from, message->rank, rss, lqi);
+		rss = neighbour_rss(neighbour);
+		lqi = neighbour_lqi(neighbour);
+		if (mote.in_dodag && linkaddr_cmp(from, &(mote.parent->addr))) { // DIO message received from parent
 
 			if (message->rank == INFINITE_RANK) { // Parent has detached from the DODAG
-				detach(&mote);
-				stop_timers();
+				repair();
 			} else { // Update info
 				// Restart timer to delete lost parent
 				ctimer_set(&parent_timer, CLOCK_SECOND*TIMEOUT_PARENT,
@@ -269,10 +413,12 @@ void broadcast_recv(struct broadcast_conn *conn, const linkaddr_t *from) {
 
 		} else {
 			// DIO message received from other mote
-			uint8_t code = choose_parent(&mote, from, message->rank, rss);
+			uint8_t code = choose_parent(&mote, from, message->rank, rss, lqi);
 		    if (code == PARENT_NEW) {
 				reset_timers();
-		    	send_DAO(&runicast, &mote);
+		    	// Announce the mote, and the subtree kept since it detached
+		    	send_DAO_subtree(&runicast, &mote);
+		    	ctimer_stop(&repair_timer);
 
 		    	// Start all timers that are used when mote is in DODAG
 		    	ctimer_set(&send_timer, trickle_random(&t_timer),
@@ -286,13 +432,18 @@ void broadcast_recv(struct broadcast_conn *conn, const linkaddr_t *from) {
 
 		    } else if (code == PARENT_CHANGED) {
 		    	// If parent has changed, send DIO message to update children
-		    	// and DAO to update routing tables, then reset timers
+		    	// and aggregated DAO to update routing tables, then reset timers
 		    	send_DIO(conn, &mote);
-		    	send_DAO(&runicast, &mote);
+		    	send_DAO_subtree(&runicast, &mote);
 		    	reset_timers();
 		    }
 		}
 
+	} else if (type == DAO_REQ) { // DAO_REQ message received
+
+		DAO_REQ_message_t* message = (DAO_REQ_message_t*) packetbuf_dataptr();
+		answer_DAO_REQ(&runicast, message, from, &mote);
+
 	} else { // Unknown message received
 		printf("Unknown broadcast message received.\n");
 	}
@@ -318,6 +469,7 @@ PROCESS_THREAD(computation_mote, ev, data) {
 	if (!created) {
 		init_mote(&mote);
 		trickle_init(&t_timer);
+		init_pending_OPEN(pending_OPENs);
 		created = 1;
 	}
 
@@ -328,6 +480,9 @@ PROCESS_THREAD(computation_mote, ev, data) {
 	broadcast_open(&broadcast, 129, &broadcast_call);
 	runicast_open(&runicast, 144, &runicast_callbacks);
 
+	// Start the statistics timer
+	ctimer_set(&stats_timer, CLOCK_SECOND*STATS_PERIOD, stats_callback, NULL);
+
 	while(1) {
 
 		// Start the sending timer
@@ -42,7 +42,8 @@ int indexFind(linkaddr_t addr, computed_mote_t computed_motes[], unsigned long c
 }
 
 /**
- * Returns the computed slope. If first_free_value_index and first_value_index are equal,
+ * Returns the computed slope [per minute], regressed on the times the values were read, so that the
+ * readings may be irregular (send-on-delta). If first_free_value_index and first_value_index are equal,
  * we consider that the buffer is of the maximum size. This function shouldn't be called
  * on an empty buffer
  */
@@ -51,36 +52,46 @@ int slope_value(int index_mote, computed_mote_t computed_motes[]) {
 	int nb_values = ((elem->first_free_value_index+MAX_NB_VALUES) - elem->first_value_index) % MAX_NB_VALUES;
 	if (nb_values == 0)
 		nb_values = MAX_NB_VALUES; // happens when pointers are the same
-	int x[nb_values];
 	uint16_t *y = (elem->values);
+	uint16_t origin = (elem->times)[elem->first_value_index];
 	int i;
 	double sum_x = 0.0, sum_y = 0.0, sum_xx = 0.0, sum_xy = 0.0;
 	for (i = 0; i < nb_values; i++) {
-		x[i] = i;
-		sum_x += i;
-		double y_i = (double) (y[(elem->first_value_index+i)%MAX_NB_VALUES]);
+		int j = (elem->first_value_index+i)%MAX_NB_VALUES;
+		// minutes since the oldest value, so that the threshold is the same as with a value per DATA_PERIOD
+		double x_i = ((uint16_t) ((elem->times)[j] - origin)) / 60.0;
+		sum_x += x_i;
+		double y_i = (double) (y[j]);
 		// casting to double is not a problem since value <= 500 and value is uint16_t (so no problem, even with the sign)
 		sum_y += y_i;
-		sum_xy = x[i]*y_i;
-		sum_xx = x[i]*x[i];
+		sum_xy += x_i*y_i;
+		sum_xx += x_i*x_i;
 	}
-	double slope = (sum_x * sum_y - nb_values * sum_xy) / (sum_x * sum_x - nb_values * sum_xx);
+	double denominator = sum_x * sum_x - nb_values * sum_xx;
+	if (denominator == 0.0)
+		return 0; // all the values were read at the same time
+	double slope = (sum_x * sum_y - nb_values * sum_xy) / denominator;
 	return ((int)(slope*100)) / 100;
 }
 
 /**
- * Adds the information received from the mote and returns whether the valve should be opened or not.
+ * Adds the information received from the mote, read at time time [sec, clock_seconds()],
+ * and returns whether the valve should be opened or not.
  */
-int add_and_check_valve(linkaddr_t addr, computed_mote_t computed_motes[], uint16_t quality_air_value) {
-	unsigned long time = clock_seconds();
+int add_and_check_valve(linkaddr_t addr, computed_mote_t computed_motes[], uint16_t quality_air_value,
+	unsigned long time) {
 	int index_mote = indexFind(addr, computed_motes, time);
 	if (index_mote == COMPUTED_BUFFER_FULL) {
-		printf("Couldn't add mote %u.%u in the computation buffer\n", addr.u8[0], addr.u8[1]);
+		frame_debug("Couldn't add mote %u.%u in the computation buffer\n", addr.u8[0], addr.u8[1]);
 		return CANNOT_ADD_MOTE;
 	}
 	uint8_t enough_values = 0; // false
 	computed_mote_t *elem = &(computed_motes[index_mote]);
 	if (elem->in_use) {
+		if (time < elem->timestamp) {
+			// older than the last value : a batch of readings received twice
+			return CLOSE_VALVE; // do not take any action
+		}
 		if ((elem->values)[(elem->first_free_value_index+MAX_NB_VALUES-1)%MAX_NB_VALUES] == quality_air_value && time - elem->timestamp < 15) {
 			// we just received a duplicate data ! (same data + delta time < 15 sec)
 			elem->timestamp = time;
@@ -101,9 +112,16 @@ int add_and_check_valve(linkaddr_t addr, computed_mote_t computed_motes[], uint1
 	}
 	elem->timestamp = time;
 	(elem->values)[elem->first_free_value_index] = quality_air_value;
+	(elem->times)[elem->first_free_value_index] = (uint16_t) time;
 	elem->first_free_value_index = (elem->first_free_value_index + 1) % MAX_NB_VALUES;
+	while (elem->first_value_index != (elem->first_free_value_index+MAX_NB_VALUES-1)%MAX_NB_VALUES
+			&& (uint16_t) (time - (elem->times)[elem->first_value_index]) > MAX_VALUE_AGE) {
+		// too old for the slope, keeping at least the new value
+		elem->first_value_index = (elem->first_value_index + 1) % MAX_NB_VALUES;
+		enough_values = 0;
+	}
 
-	printf("CM : mote %u.%u, value %u\n", addr.u8[0], addr.u8[1], quality_air_value);
+	frame_debug("CM : mote %u.%u, value %u\n", addr.u8[0], addr.u8[1], quality_air_value);
 
 	if (((elem->first_free_value_index+MAX_NB_VALUES) - elem->first_value_index) % MAX_NB_VALUES >= MIN_NB_VALUES_COMPUTE) {
 		// enough values to compute whether we should open the valve
@@ -15,9 +15,20 @@
 #define CANNOT_ADD_MOTE 3
 #define MIN_NB_VALUES_COMPUTE 10 // minimum values needed to do the computation
 #define MAX_NB_VALUES 30 // maximum number of values about the mote
+#define MAX_VALUE_AGE 1800 // values older than this [sec] are removed, so that the slope covers the same time whatever the sampling (send-on-delta)
 #define MAX_NB_COMPUTED 5 // this node can compute the needed values for only this number of nodes
 #define SLOPE_THRESHOLD 0 // definition of the threshold for which we should open valves to improve air quality
-#define TIMEOUT_DATA 300 // this timeout is used to know when we should erase data from a node from which we haven't received any DATA message for TIMEOUT_DATA seconds
+// this timeout is used to know when we should erase data from a node from which we haven't received any DATA message
+// for TIMEOUT_DATA seconds : longer, by one DATA_PERIOD at least, than the time between two messages of a sensor mote
+// (BATCH_LATENCY + DATA_PERIOD with batches, HEARTBEAT_PERIOD + DATA_PERIOD with send-on-delta, checked in sensor-mote.c).
+// Longer only when the readings are batched (BATCH_SIZE set for the whole build, make DEFINES=BATCH_SIZE=5)
+#ifndef TIMEOUT_DATA
+#if BATCH_SIZE > 1
+#define TIMEOUT_DATA 600
+#else
+#define TIMEOUT_DATA 300
+#endif
+#endif
 
 
 
@@ -30,6 +41,7 @@ typedef struct computed_mote {
 	unsigned long timestamp;
 	uint8_t in_use;
 	uint16_t values[MAX_NB_VALUES];
+	uint16_t times[MAX_NB_VALUES]; // time [sec] each value was read, modulo 2^16 (enough for their differences)
 	uint8_t first_value_index;
 	uint8_t first_free_value_index;
 	//size is not needed if when created, we add an element directly
@@ -49,13 +61,16 @@ typedef struct computed_mote {
 int indexFind(linkaddr_t addr, computed_mote_t computed_motes[], unsigned long curr_time);
 
 /**
- * Returns the computed slope. If first_free_value_index and first_value_index are equal,
+ * Returns the computed slope [per minute], regressed on the times the values were read, so that the
+ * readings may be irregular (send-on-delta). If first_free_value_index and first_value_index are equal,
  * we consider that the buffer is of the maximum size. This function shouldn't be called
  * on an empty buffer
  */
 int slope_value(int index_mote, computed_mote_t computed_motes[]);
 
 /**
- * Adds the information received from the mote and returns whether the valve should be opened or not
+ * Adds the information received from the mote, read at time time [sec, clock_seconds()],
+ * and returns whether the valve should be opened or not
  */
-int add_and_check_valve(linkaddr_t addr, computed_mote_t computed_motes[], uint16_t quality_air_value);
+int add_and_check_valve(linkaddr_t addr, computed_mote_t computed_motes[], uint16_t quality_air_value,
+	unsigned long time);
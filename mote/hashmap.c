@@ -1,4 +1,5 @@
 #include "hashmap.h"
+#include "serial-frame.h"
 
 /**
  * Converts a linkaddr_t to a uint16_t
@@ -32,13 +33,13 @@ int hashmap_hash(hashmap_map *m, uint16_t key) {
 
 	/* If full, return immediately */
 	if(2*m->size >= m->table_size) {
-		if (DEBUG_MODE) printf("Map at least half full, resizing\n");
+		if (DEBUG_MODE) frame_debug("Map at least half full, resizing\n");
 		return MAP_FULL;
 	}
 
 	/* Find the best index */
 	curr = key % m->table_size;
-	if (DEBUG_MODE) printf("Best index for key %u is %d\n", key, curr);
+	if (DEBUG_MODE) frame_debug("Best index for key %u is %d\n", key, curr);
 
 	/* Value of index if found */
 	int firstInd = MAP_FULL;
@@ -84,7 +85,7 @@ int hashmap_fill_rehash(hashmap_map *m, hashmap_element *old_array, int old_tabl
 	/* Rehash the elements */
 	int i;
 	for(i = 0; i < old_table_size; i++) {
-		if (DEBUG_MODE) printf("Rehashing, i : %d, old_table_size : %d\n", i, old_table_size);
+		if (DEBUG_MODE) frame_debug("Rehashing, i : %d, old_table_size : %d\n", i, old_table_size);
 		if (old_array[i].in_use == 0)
 		    continue;
 	    	uint8_t isRehashing = 1;
@@ -94,7 +95,7 @@ int hashmap_fill_rehash(hashmap_map *m, hashmap_element *old_array, int old_tabl
 			return status;
 		}
 		if (status == MAP_OMEM) {
-			printf("ERROR : MAP_OMEM in simple rehash, should not happen\n");
+			frame_debug("ERROR : MAP_OMEM in simple rehash, should not happen\n");
 			return MAP_OMEM;
 		}
 	}
@@ -108,7 +109,7 @@ int hashmap_fill_rehash(hashmap_map *m, hashmap_element *old_array, int old_tabl
  */
 int hashmap_rehash(hashmap_map *m) {
 	if (DEBUG_MODE) {
-		printf("Rehashing hashmap, printing before\n");
+		frame_debug("Rehashing hashmap, printing before\n");
 		hashmap_print(m);
 	}
 
@@ -124,7 +125,7 @@ int hashmap_rehash(hashmap_map *m) {
 		hashmap_element* temp = (hashmap_element *)
 		my_calloc(new_table_size, sizeof(hashmap_element));
 		if(!temp) {
-			printf("MAP_OMEM when tried to alloc %d elements of size %d\n", 2 * m->table_size, sizeof(hashmap_element));
+			frame_debug("MAP_OMEM when tried to alloc %d elements of size %d\n", 2 * m->table_size, sizeof(hashmap_element));
 			return MAP_OMEM;
 		}
 
@@ -137,14 +138,14 @@ int hashmap_rehash(hashmap_map *m) {
 	
 	if (status == MAP_OMEM) {
 		// should not happen
-		printf("Hashmap rehash encountered MAP_OMEM, not normal\n");
+		frame_debug("Hashmap rehash encountered MAP_OMEM, not normal\n");
 		return MAP_OMEM;
 	}
 
 
 	free(curr); // free old data
 	if (DEBUG_MODE) {
-		printf("Hashmap rehashed, printing new\n");
+		frame_debug("Hashmap rehashed, printing new\n");
 		hashmap_print(m);
 	}
 
@@ -179,7 +180,7 @@ hashmap_map * hashmap_new() {
  * 		  MAP_UPDATE if an element was updated.
  */
 int hashmap_put_int(hashmap_map *m, uint16_t key, linkaddr_t value, unsigned long time, uint8_t isRehashing) {
-	if (DEBUG_MODE) printf("Trying to put node %u. Rehashing : %d\n", key, isRehashing);
+	if (DEBUG_MODE) frame_debug("Trying to put node %u. Rehashing : %d\n", key, isRehashing);
 	if (!isRehashing && DEBUG_MODE) {
 		hashmap_print(m);
 	}
@@ -191,11 +192,11 @@ int hashmap_put_int(hashmap_map *m, uint16_t key, linkaddr_t value, unsigned lon
 	while(index == MAP_FULL) {
 		if (isRehashing) {
 			// to be sure we don't call rehash while already in rehash
-			if (DEBUG_MODE) printf("MAP_FULL when already rehashing -> double rehash at least\n");
+			if (DEBUG_MODE) frame_debug("MAP_FULL when already rehashing -> double rehash at least\n");
 			return MAP_FULL;
 		}
 		if (hashmap_rehash(m) == MAP_OMEM) {
-			printf("Out of memory when trying to put node %u\n", key);
+			frame_debug("Out of memory when trying to put node %u\n", key);
 			return MAP_OMEM;
 		}
 		index = hashmap_hash(m, key);
@@ -210,7 +211,7 @@ int hashmap_put_int(hashmap_map *m, uint16_t key, linkaddr_t value, unsigned lon
 	m->data[index].data = value;
 	m->data[index].time = time;
 	m->data[index].key = key;
-	if (DEBUG_MODE) printf("Node with key %u added\n",key);
+	if (DEBUG_MODE) frame_debug("Node with key %u added\n",key);
 
 	return ret;
 
@@ -286,14 +287,14 @@ int hashmap_remove_int(hashmap_map *m, uint16_t key) {
 
                 /* Reduce the size */
                 m->size--;
-		if (DEBUG_MODE) printf("Node with key %u was removed from hashmap\n",key);
+		if (DEBUG_MODE) frame_debug("Node with key %u was removed from hashmap\n",key);
                 return MAP_OK;
             }
 		}
 		curr = (curr + 1) % m->table_size;
 	}
 
-	if (DEBUG_MODE) printf("Error : element with key addr %u could not be found and thus wasn't removed\n", key);
+	if (DEBUG_MODE) frame_debug("Error : element with key addr %u could not be found and thus wasn't removed\n", key);
 	/* Data not found */
 	return MAP_MISSING;
 }
@@ -325,18 +326,51 @@ int hashmap_length(hashmap_map *m) {
  * Prints the content of the hashmap
  */
 void hashmap_print(hashmap_map *m) {
-	printf("Printing hashmap\n");
+	frame_debug("Printing hashmap\n");
 	hashmap_element* map = m->data;
 	int i;
 	for (i = 0; i < m->table_size; i++) {
 		hashmap_element elem = *(map+i);
 		if (elem.in_use) {
-			printf("index %d : %u; reachable from %u\n",
+			frame_debug("index %d : %u; reachable from %u\n",
 				i, elem.key, linkaddr2uint16_t(elem.data));
 		}
 	}
 }
 
+/**
+ * Copies at most max keys of the hashmap in keys
+ * Return value : the number of copied keys
+ */
+int hashmap_keys(hashmap_map *m, linkaddr_t keys[], int max) {
+	int nb = 0;
+	int i;
+	for (i = 0; i < m->table_size && nb < max; i++) {
+		if (m->data[i].in_use) {
+			keys[nb].u16 = m->data[i].key;
+			nb++;
+		}
+	}
+	return nb;
+}
+
+/**
+ * Removes the element with key addr, and the elements whose value is addr
+ * Return value : the number of removed elements
+ */
+int hashmap_remove_routes(hashmap_map *m, linkaddr_t addr) {
+	int nb = 0;
+	int i;
+	for (i = 0; i < m->table_size; i++) {
+		if (m->data[i].in_use && (m->data[i].key == addr.u16 || linkaddr_cmp(&(m->data[i].data), &addr))) {
+			m->data[i].in_use = 0;
+			m->size--;
+			nb++;
+		}
+	}
+	return nb;
+}
+
 /**
  * Removes entries that have timed out (based on current time and TIMEOUT_CHILDREN)
  * Design choice : unsigned long overflow is not taken into account since it would wrap up in ~= 135 years
@@ -350,7 +384,7 @@ int hashmap_delete_timeout(hashmap_map *m) {
 		if (runner[i].in_use && clock_seconds() > runner[i].time + TIMEOUT_CHILDREN) {
 			// entry timeout
 			runner[i].in_use = 0;
-			printf("Node with addr %u timed out -> deleted\n", runner[i].key);
+			frame_debug("Node with addr %u timed out -> deleted\n", runner[i].key);
 			ret = 1;
 		}
 	}
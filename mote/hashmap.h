@@ -154,6 +154,18 @@ extern int hashmap_length(hashmap_map *m);
  */
 extern void hashmap_print(hashmap_map *m);
 
+/**
+ * Copies at most max keys of the hashmap in keys
+ * Return value : the number of copied keys
+ */
+extern int hashmap_keys(hashmap_map *m, linkaddr_t keys[], int max);
+
+/**
+ * Removes the element with key addr, and the elements whose value is addr
+ * Return value : the number of removed elements
+ */
+extern int hashmap_remove_routes(hashmap_map *m, linkaddr_t addr);
+
 /**
  * Removes entries that have timed out (based on arguments current_time and timeout_delay)
  * Design choice : unsigned long overflow is not taken into account since it would wrap up in ~= 135 years
@@ -0,0 +1,117 @@
+/**
+ * Defines data and functions for the neighbour table of the motes,
+ * which keeps smoothed link metrics about the neighbours heard through DIO messages.
+ */
+
+#include "neighbour-table.h"
+
+
+///////////////////
+///  FUNCTIONS  ///
+///////////////////
+
+/**
+ * Initializes an empty neighbour table.
+ */
+void neighbour_init(neighbour_t neighbours[]) {
+	int i;
+	for (i = 0; i < MAX_NB_NEIGHBOURS; i++) {
+		neighbours[i].in_use = 0;
+	}
+}
+
+/**
+ * Returns the entry of the neighbour with address addr, or NULL if it isn't in the table.
+ */
+neighbour_t* neighbour_find(neighbour_t neighbours[], const linkaddr_t *addr) {
+	int i;
+	for (i = 0; i < MAX_NB_NEIGHBOURS; i++) {
+		if (neighbours[i].in_use && linkaddr_cmp(addr, &(neighbours[i].addr))) {
+			return &(neighbours[i]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Returns the new smoothed value of a metric, given its previous smoothed value and a new sample.
+ */
+int16_t ewma(int16_t smoothed, int16_t sample) {
+	return smoothed + (sample*EWMA_SCALE - smoothed) / EWMA_DIVISOR;
+}
+
+/**
+ * Updates the entry of the neighbour with address addr with a new sample of its link metrics,
+ * and returns it. If the neighbour is new, it takes the place of a timed out neighbour or,
+ * if the table is full, of the neighbour that was heard the least recently.
+ */
+neighbour_t* neighbour_update(neighbour_t neighbours[], const linkaddr_t *addr, uint8_t rank, signed char rss, uint8_t lqi) {
+	unsigned long time = clock_seconds();
+	neighbour_t *neighbour = neighbour_find(neighbours, addr);
+
+	if (neighbour) {
+		// Known neighbour, smooth its metrics
+		neighbour->rss = ewma(neighbour->rss, rss);
+		neighbour->lqi = ewma(neighbour->lqi, lqi);
+	} else {
+		// New neighbour, find a free entry or the least recently heard one
+		neighbour_delete_timeout(neighbours);
+		int i;
+		for (i = 0; i < MAX_NB_NEIGHBOURS; i++) {
+			if (!neighbours[i].in_use) {
+				neighbour = &(neighbours[i]);
+				break;
+			} else if (!neighbour || neighbours[i].last_heard < neighbour->last_heard) {
+				neighbour = &(neighbours[i]);
+			}
+		}
+		// The first sample initializes the smoothed metrics
+		neighbour->in_use = 1;
+		linkaddr_copy(&(neighbour->addr), addr);
+		neighbour->rss = rss*EWMA_SCALE;
+		neighbour->lqi = lqi*EWMA_SCALE;
+	}
+
+	neighbour->rank = rank;
+	neighbour->last_heard = time;
+	return neighbour;
+}
+
+/**
+ * Returns the smoothed RSS of a neighbour, in dB.
+ */
+signed char neighbour_rss(neighbour_t *neighbour) {
+	return (signed char) (neighbour->rss / EWMA_SCALE);
+}
+
+/**
+ * Returns the smoothed LQI of a neighbour.
+ */
+uint8_t neighbour_lqi(neighbour_t *neighbour) {
+	return (uint8_t) (neighbour->lqi / EWMA_SCALE);
+}
+
+/**
+ * Returns 1 if the link with the neighbour is good enough for it to be a parent (smoothed LQI of at least
+ * LQI_FLOOR), 0 otherwise. A strong but corrupted signal (interference) gives a high RSS and a low LQI.
+ */
+uint8_t neighbour_reliable(neighbour_t *neighbour) {
+	return neighbour_lqi(neighbour) >= LQI_FLOOR;
+}
+
+/**
+ * Removes the neighbours that haven't been heard for TIMEOUT_NEIGHBOUR seconds.
+ * Returns the number of removed neighbours.
+ */
+int neighbour_delete_timeout(neighbour_t neighbours[]) {
+	unsigned long time = clock_seconds();
+	int removed = 0;
+	int i;
+	for (i = 0; i < MAX_NB_NEIGHBOURS; i++) {
+		if (neighbours[i].in_use && time > neighbours[i].last_heard + TIMEOUT_NEIGHBOUR) {
+			neighbours[i].in_use = 0;
+			removed++;
+		}
+	}
+	return removed;
+}
@@ -0,0 +1,93 @@
+/**
+ * Defines data and functions for the neighbour table of the motes,
+ * which keeps smoothed link metrics about the neighbours heard through DIO messages.
+ */
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+
+///////////////////
+///  CONSTANTS  ///
+///////////////////
+
+// Maximum number of neighbours kept in the table
+#define MAX_NB_NEIGHBOURS 8
+
+// Timeout value [sec] to forget a neighbour that hasn't sent a DIO
+#define TIMEOUT_NEIGHBOUR 60
+
+// Smoothed metrics are stored as fixed-point values, multiplied by this scale
+#define EWMA_SCALE 16
+
+// Inverse of the weight of a new sample in the smoothed metrics (weight = 1/EWMA_DIVISOR)
+#define EWMA_DIVISOR 4
+
+// Minimum smoothed LQI (CC2420 correlation, about 110 for a perfect link, 50 for the worst) of a parent
+#ifndef LQI_FLOOR
+#define LQI_FLOOR 70
+#endif
+
+
+
+////////////////////
+///  DATA TYPES  ///
+////////////////////
+
+// Represents a neighbour of a mote, with its smoothed link metrics
+typedef struct neighbour {
+	linkaddr_t addr;
+	uint8_t in_use;
+	uint8_t rank;
+	int16_t rss; // smoothed RSS, multiplied by EWMA_SCALE
+	int16_t lqi; // smoothed LQI, multiplied by EWMA_SCALE
+	unsigned long last_heard;
+} neighbour_t;
+
+
+
+///////////////////
+///  FUNCTIONS  ///
+///////////////////
+
+/**
+ * Initializes an empty neighbour table.
+ */
+void neighbour_init(neighbour_t neighbours[]);
+
+/**
+ * Returns the entry of the neighbour with address addr, or NULL if it isn't in the table.
+ */
+neighbour_t* neighbour_find(neighbour_t neighbours[], const linkaddr_t *addr);
+
+/**
+ * Updates the entry of the neighbour with address addr with a new sample of its link metrics,
+ * and returns it. If the neighbour is new, it takes the place of a timed out neighbour or,
+ * if the table is full, of the neighbour that was heard the least recently.
+ */
+neighbour_t* neighbour_update(neighbour_t neighbours[], const linkaddr_t *addr, uint8_t rank, signed char rss, uint8_t lqi);
+
+/**
+ * Returns the smoothed RSS of a neighbour, in dB.
+ */
+signed char neighbour_rss(neighbour_t *neighbour);
+
+/**
+ * Returns the smoothed LQI of a neighbour.
+ */
+uint8_t neighbour_lqi(neighbour_t *neighbour);
+
+/**
+ * Returns 1 if the link with the neighbour is good enough for it to be a parent (smoothed LQI of at least
+ * LQI_FLOOR), 0 otherwise. A strong but corrupted signal (interference) gives a high RSS and a low LQI.
+ */
+uint8_t neighbour_reliable(neighbour_t *neighbour);
+
+/**
+ * Removes the neighbours that haven't been heard for TIMEOUT_NEIGHBOUR seconds.
+ * Returns the number of removed neighbours.
+ */
+int neighbour_delete_timeout(neighbour_t neighbours[]);
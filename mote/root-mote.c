@@ -12,8 +12,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "random.h"
-#include "serial-line.h"
 
+// Size of the buffer of DATA readings waiting to be sent to the server
+#define INGRESS_BUFFER_SIZE 64
+
+// Number of buffered readings that triggers sending them to the server
+#define FLUSH_SIZE 16
+
+// Maximum time [sec] a reading waits in the buffer before being sent to the server
+#define FLUSH_PERIOD 1
+
+// Period [sec] of the reports of the buffer statistics to the server
+#define INGRESS_STATS_PERIOD 60
+
+// Maximum number of OPEN commands of the server waiting to be sent
+#define COMMAND_QUEUE_SIZE 16
+
+// Maximum number of OPEN commands followed after being sent (for route misses) or waiting to be retried
+#define MAX_TRACKED_COMMANDS 8
+
+
+// Process sending the buffered readings to the server
+PROCESS_NAME(serial_output);
 
 // Represents the attributes of this mote
 mote_t mote;
@@ -22,6 +42,9 @@ uint8_t created = 0;
 // Trickle timer for the periodic messages
 trickle_timer_t t_timer;
 
+// Pending DIO answer to received DIS messages
+DIO_response_t DIO_response;
+
 // Broadcast connection
 static struct broadcast_conn broadcast;
 
@@ -30,6 +53,269 @@ static struct runicast_conn runicast;
 
 
 
+////////////////////////
+///  INGRESS BUFFER  ///
+////////////////////////
+
+// Represents a DATA reading waiting to be sent to the server
+typedef struct reading {
+	uint16_t addr;
+	uint16_t data;
+	uint16_t time; // time [sec] the reading was read, modulo 2^16 (enough for its age)
+} reading_t;
+
+// Ring buffer of readings, filled by the radio and drained by the serial_output process
+static reading_t ingress[INGRESS_BUFFER_SIZE];
+static uint8_t ingress_first = 0;
+static uint8_t ingress_count = 0;
+
+// Statistics of the buffer since the last report : dropped readings and maximum number of buffered readings
+static uint16_t ingress_dropped = 0;
+static uint16_t ingress_max_count = 0;
+
+/**
+ * Adds a reading, read at time time [sec, clock_seconds()], to the buffer, and wakes the serial_output
+ * process up if FLUSH_SIZE readings are waiting.
+ * The reading is dropped and counted if the buffer is full.
+ */
+void ingress_add(uint16_t addr, uint16_t data, unsigned long time) {
+	if (ingress_count == INGRESS_BUFFER_SIZE) {
+		ingress_dropped++;
+		return;
+	}
+	reading_t *reading = &(ingress[(ingress_first + ingress_count) % INGRESS_BUFFER_SIZE]);
+	reading->addr = addr;
+	reading->data = data;
+	reading->time = (uint16_t) time;
+	ingress_count++;
+
+	if (ingress_count > ingress_max_count) {
+		ingress_max_count = ingress_count;
+	}
+	if (ingress_count >= FLUSH_SIZE) {
+		process_poll(&serial_output);
+	}
+}
+
+/**
+ * Sends the oldest buffered readings to the server, as many as fit in one frame.
+ * The server gets the age of the readings, since the root has no wall clock.
+ */
+void ingress_flush_frame() {
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+	uint8_t length = 0;
+	uint16_t now = (uint16_t) clock_seconds();
+	while (ingress_count > 0 && length + DATA_RECORD_SIZE <= FRAME_MAX_PAYLOAD) {
+		reading_t *reading = &(ingress[ingress_first]);
+		frame_put_u16(payload + length, reading->addr);
+		frame_put_u16(payload + length + 2, reading->data);
+		frame_put_u16(payload + length + 4, (uint16_t) (now - reading->time));
+		length += DATA_RECORD_SIZE;
+		ingress_first = (ingress_first + 1) % INGRESS_BUFFER_SIZE;
+		ingress_count--;
+	}
+	frame_send(FRAME_DATA, payload, length);
+}
+
+/**
+ * Sends the statistics of the buffer to the server, and restarts counting.
+ */
+void ingress_report() {
+	uint8_t payload[STATS_RECORD_SIZE];
+	frame_put_u16(payload, ingress_dropped);
+	frame_put_u16(payload + 2, ingress_max_count);
+	frame_send(FRAME_STATS, payload, STATS_RECORD_SIZE);
+	ingress_dropped = 0;
+	ingress_max_count = ingress_count;
+}
+
+
+
+///////////////////////
+///  COMMAND QUEUE  ///
+///////////////////////
+
+// States of a tracked command
+#define COMMAND_FREE      0
+#define COMMAND_DELIVERED 1 // delivered to the next hop, a ROUTE_MISS may still come back
+#define COMMAND_RETRY     2 // waiting OPEN_RETRY_DELAY seconds before being sent again
+
+// Represents an OPEN or CONFIG command of the server
+typedef struct command {
+	uint16_t id;
+	uint8_t type; // OPEN or CONFIG
+	linkaddr_t dst_addr;
+	int16_t threshold; // threshold of a CONFIG command
+	uint8_t retries;
+	uint8_t state;
+	unsigned long timestamp;
+} command_t;
+
+// Commands waiting to be sent, the first one is sent when runicast is free
+static command_t commands[COMMAND_QUEUE_SIZE];
+static uint8_t commands_first = 0;
+static uint8_t commands_count = 0;
+
+// Command whose OPEN or CONFIG message is being sent by runicast
+static command_t in_flight;
+static uint8_t is_in_flight = 0;
+
+// Commands delivered recently, or waiting to be retried after a route miss
+static command_t tracked[MAX_TRACKED_COMMANDS];
+
+// Callback timer to retry commands after a route miss
+struct ctimer retry_timer;
+
+/**
+ * Sends the outcome of a command to the server.
+ */
+void command_ack(command_t *command, uint8_t status) {
+	uint8_t record[ACK_RECORD_SIZE];
+	frame_put_u16(record, command->id);
+	frame_put_u16(record + 2, command->dst_addr.u16);
+	record[4] = status;
+	frame_send(FRAME_ACK, record, ACK_RECORD_SIZE);
+}
+
+/**
+ * Adds a command at the end of the queue.
+ * Returns 1 if it was added, 0 if the queue is full (the command is then acknowledged as failed).
+ */
+uint8_t command_enqueue(command_t *command) {
+	if (commands_count == COMMAND_QUEUE_SIZE) {
+		command_ack(command, ACK_QUEUE_FULL);
+		return 0;
+	}
+	commands[(commands_first + commands_count) % COMMAND_QUEUE_SIZE] = *command;
+	commands_count++;
+	return 1;
+}
+
+/**
+ * Returns a free entry of the tracked commands, or NULL if there is none.
+ * Delivered commands are forgotten after TIMEOUT_PENDING_OPEN seconds.
+ */
+command_t* command_track() {
+	unsigned long time = clock_seconds();
+	int i;
+	for (i = 0; i < MAX_TRACKED_COMMANDS; i++) {
+		if (tracked[i].state == COMMAND_DELIVERED && time > tracked[i].timestamp + TIMEOUT_PENDING_OPEN) {
+			tracked[i].state = COMMAND_FREE;
+		}
+		if (tracked[i].state == COMMAND_FREE) {
+			return &(tracked[i]);
+		}
+	}
+	return NULL;
+}
+
+void retry_callback(void *ptr);
+
+/**
+ * Schedules a command to be sent again after a route miss, at most MAX_OPEN_RETRIES times.
+ * Otherwise, the command is acknowledged as failed.
+ */
+void command_retry(command_t *command) {
+	command_t *entry = command_track();
+	if (command->retries >= MAX_OPEN_RETRIES || !entry) {
+		command_ack(command, ACK_NO_ROUTE);
+		return;
+	}
+	*entry = *command;
+	entry->retries++;
+	entry->state = COMMAND_RETRY;
+	entry->timestamp = clock_seconds();
+	if (ctimer_expired(&retry_timer)) {
+		ctimer_set(&retry_timer, CLOCK_SECOND, retry_callback, NULL);
+	}
+}
+
+/**
+ * Sends the OPEN or CONFIG message of the first command of the queue, if runicast is free.
+ * Commands without route are scheduled for a retry, and the next ones are tried.
+ */
+void commands_send() {
+	while (!is_in_flight && !runicast_is_transmitting(&runicast) && commands_count > 0) {
+		command_t command = commands[commands_first];
+		commands_first = (commands_first + 1) % COMMAND_QUEUE_SIZE;
+		commands_count--;
+
+		int sent = command.type == CONFIG ? send_CONFIG(&runicast, command.dst_addr, command.threshold, &mote)
+			: send_OPEN(&runicast, command.dst_addr, &mote);
+		if (sent == SENT) {
+			in_flight = command;
+			is_in_flight = 1;
+		} else {
+			// No route towards the sensor mote, ask for a fresh DAO and retry later
+			send_DAO_REQ(&broadcast, command.dst_addr);
+			command_retry(&command);
+		}
+	}
+}
+
+/**
+ * Callback function that puts back in the queue the commands whose retry delay has expired.
+ */
+void retry_callback(void *ptr) {
+	unsigned long time = clock_seconds();
+	uint8_t waiting = 0;
+	int i;
+	for (i = 0; i < MAX_TRACKED_COMMANDS; i++) {
+		if (tracked[i].state == COMMAND_RETRY) {
+			if (time >= tracked[i].timestamp + OPEN_RETRY_DELAY) {
+				tracked[i].state = COMMAND_FREE;
+				frame_debug("%s to mote %u.%u retried (%u/%u)", tracked[i].type == CONFIG ? "CONFIG" : "OPEN",
+					tracked[i].dst_addr.u8[0], tracked[i].dst_addr.u8[1], tracked[i].retries, MAX_OPEN_RETRIES);
+				command_enqueue(&(tracked[i]));
+			} else {
+				waiting = 1;
+			}
+		}
+	}
+	if (waiting) {
+		ctimer_reset(&retry_timer);
+	}
+	commands_send();
+}
+
+/**
+ * Handles the end of the sending of the command in flight by runicast.
+ * A delivered command is tracked, so that it can be retried if a ROUTE_MISS comes back.
+ */
+void command_sent(uint8_t status) {
+	if (!is_in_flight) {
+		return;
+	}
+	is_in_flight = 0;
+	command_ack(&in_flight, status);
+
+	command_t *entry;
+	if (status == ACK_DELIVERED && (entry = command_track())) {
+		*entry = in_flight;
+		entry->state = COMMAND_DELIVERED;
+		entry->timestamp = clock_seconds();
+	}
+	commands_send();
+}
+
+/**
+ * Handles a ROUTE_MISS about a command delivered recently : the command of the same type towards the same
+ * destination is retried.
+ */
+void command_route_miss(linkaddr_t dst_addr, uint8_t type) {
+	int i;
+	for (i = 0; i < MAX_TRACKED_COMMANDS; i++) {
+		if (tracked[i].state == COMMAND_DELIVERED && tracked[i].type == type
+				&& linkaddr_cmp(&dst_addr, &(tracked[i].dst_addr))) {
+			tracked[i].state = COMMAND_FREE;
+			command_retry(&(tracked[i]));
+			return;
+		}
+	}
+}
+
+
+
 /////////////////////////
 ///  CALLBACK TIMERS  ///
 /////////////////////////
@@ -96,7 +382,7 @@ void runicast_recv(struct runicast_conn *conn, const linkaddr_t *from, uint8_t s
 
 	if (type == DAO) {
 
-		//printf("DAO message received from %u.%u\n", from->u8[0], from->u8[1]);
+		//frame_debug("DAO message received from %u.%u\n", from->u8[0], from->u8[1]);
 
 		DAO_message_t* message = (DAO_message_t*) packetbuf_dataptr();
 
@@ -108,16 +394,58 @@ void runicast_recv(struct runicast_conn *conn, const linkaddr_t *from, uint8_t s
 			// Reset trickle timer and sending timer
 			reset_timers(&t_timer);
 		} else if (err != MAP_NEW && err != MAP_UPDATE) {
-			printf("Error adding to routing table\n");
+			frame_debug("Error adding to routing table\n");
+		}
+
+	} else if (type == DAO_AGG) {
+
+		// Aggregated DAO of a repaired subtree, add all its routes
+		DAO_AGG_message_t* message = (DAO_AGG_message_t*) packetbuf_dataptr();
+
+		int err = add_DAO_AGG_routes(mote.routing_table, message, from);
+		if (err == MAP_NEW) { // New children were added to the routing table
+			reset_timers(&t_timer);
+		} else if (err != MAP_UPDATE) {
+			frame_debug("Error adding to routing table\n");
 		}
 
 	} else if (type == DATA) {
 
+		// Buffer the DATA, the serial_output process sends it to the server
 		DATA_message_t* message = (DATA_message_t*) packetbuf_dataptr();
-		printf("%u/%u/%u\n", message->type, message->src_addr.u16, message->data);
+		ingress_add(message->src_addr.u16, message->data, clock_seconds());
+
+	} else if (type == DATA_BATCH) {
+
+		// Buffer each reading of the batch, with the time it was read
+		DATA_BATCH_message_t* message = (DATA_BATCH_message_t*) packetbuf_dataptr();
+		unsigned long now = clock_seconds();
+		uint8_t i;
+		for (i = 0; i < message->nb && i < MAX_DATA_BATCH; i++) {
+			ingress_add(message->src_addr.u16, message->readings[i].data,
+				now - message->age - message->readings[i].delta);
+		}
+
+	} else if (type == VALVE) {
+
+		// A sensor mote opened its valve itself, tell the server at once
+		VALVE_message_t* message = (VALVE_message_t*) packetbuf_dataptr();
+		uint8_t record[VALVE_RECORD_SIZE];
+		frame_put_u16(record, message->src_addr.u16);
+		frame_put_u16(record + 2, (uint16_t) message->slope);
+		frame_send(FRAME_VALVE, record, VALVE_RECORD_SIZE);
+
+	} else if (type == ROUTE_MISS) {
+
+		// An OPEN or CONFIG message sent by the root couldn't reach its destination, retry it
+		ROUTE_MISS_message_t* message = (ROUTE_MISS_message_t*) packetbuf_dataptr();
+		if (linkaddr_cmp(&(message->src_addr), &(mote.addr))) {
+			command_route_miss(message->dst_addr, message->msg_type);
+			commands_send();
+		}
 
 	} else {
-		printf("Unknown runicast message received.\n");
+		frame_debug("Unknown runicast message received.\n");
 	}
 
 
@@ -127,14 +455,16 @@ void runicast_recv(struct runicast_conn *conn, const linkaddr_t *from, uint8_t s
  * Callback function, called when an unicast packet is sent
  */
 void runicast_sent(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
-	// Nothing to do
+	// The root only sends OPEN and CONFIG messages, send the next command
+	command_sent(ACK_DELIVERED);
 }
 
 /**
  * Callback function, called when an unicast packet has timed out
  */
 void runicast_timeout(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
-	// Nothing to do
+	// The root only sends OPEN and CONFIG messages, send the next command
+	command_sent(ACK_FAILED);
 }
 
 const struct runicast_callbacks runicast_callbacks = {runicast_recv, runicast_sent, runicast_timeout};
@@ -153,10 +483,10 @@ void broadcast_recv(struct broadcast_conn *conn, const linkaddr_t *from) {
 	uint8_t type = *data;
 
 	if (type == DIS) {
-		//printf("DIS packet received.\n");
-		// If the mote is already in a DODAG, send DIO packet
+		//frame_debug("DIS packet received.\n");
+		// If the mote is already in a DODAG, answer with a DIO after a random delay
 		if (mote.in_dodag) {
-			send_DIO(conn, &mote);
+			schedule_DIO_response(&DIO_response, conn, &mote);
 		}
 	}
 
@@ -173,8 +503,9 @@ const struct broadcast_callbacks broadcast_call = {broadcast_recv};
 // Create and start the process
 PROCESS(root_mote, "Root mote");
 PROCESS(server_communication, "Server communication");
+PROCESS(serial_output, "Serial output");
 
-AUTOSTART_PROCESSES(&root_mote, &server_communication);
+AUTOSTART_PROCESSES(&root_mote, &server_communication, &serial_output);
 
 PROCESS_THREAD(root_mote, ev, data) {
 
@@ -208,24 +539,84 @@ PROCESS_THREAD(root_mote, ev, data) {
 }
 
 PROCESS_THREAD(server_communication, ev, data) {
-    PROCESS_BEGIN();
-
-    while(1) {
-        PROCESS_YIELD();
-        if(ev == serial_line_event_message) {
-            char *str_data = (char *)data;
-            printf("Received line: %s\n", str_data);
-            uint8_t type = atoi(strtok(str_data, "/"));
-            if (type == OPEN){
-                uint16_t dst_addr = atoi(strtok(NULL, "/"));
-                linkaddr_t addr;
-                addr.u16 = dst_addr;
-                printf("OPEN message to mote %u.%u\n", addr.u8[0], addr.u8[1]);
-                send_OPEN(&runicast, addr, &mote);
-            } else {
-                printf("Unexpected message from server\n");
-            }
-        }
-    }
-    PROCESS_END();
+
+	// Last frame received from the server
+	static frame_t frame;
+
+	PROCESS_BEGIN();
+
+	// Read the binary frames of the server on the serial line
+	frame_init(&server_communication);
+
+	while(1) {
+		PROCESS_YIELD();
+		if (ev == PROCESS_EVENT_POLL) {
+			while (frame_read(&frame)) {
+				if (frame.type == FRAME_OPEN) {
+					// One OPEN record per command, queued until runicast is free
+					uint8_t i;
+					for (i = 0; i + OPEN_RECORD_SIZE <= frame.length; i += OPEN_RECORD_SIZE) {
+						command_t command;
+						command.id = frame_get_u16(frame.payload + i);
+						command.type = OPEN;
+						command.dst_addr.u16 = frame_get_u16(frame.payload + i + 2);
+						command.retries = 0;
+						command_enqueue(&command);
+					}
+					commands_send();
+				} else if (frame.type == FRAME_CONFIG) {
+					// One CONFIG record per command, queued with the OPEN commands
+					uint8_t i;
+					for (i = 0; i + CONFIG_RECORD_SIZE <= frame.length; i += CONFIG_RECORD_SIZE) {
+						command_t command;
+						command.id = frame_get_u16(frame.payload + i);
+						command.type = CONFIG;
+						command.dst_addr.u16 = frame_get_u16(frame.payload + i + 2);
+						command.threshold = (int16_t) frame_get_u16(frame.payload + i + 4);
+						command.retries = 0;
+						command_enqueue(&command);
+					}
+					commands_send();
+				} else {
+					frame_debug("Unexpected frame from server");
+				}
+			}
+		}
+	}
+
+	PROCESS_END();
+}
+
+PROCESS_THREAD(serial_output, ev, data) {
+
+	// Timer to send the buffered readings, and timer to report the statistics of the buffer
+	static struct etimer flush_timer;
+	static struct etimer stats_timer;
+
+	PROCESS_BEGIN();
+
+	etimer_set(&flush_timer, CLOCK_SECOND*FLUSH_PERIOD);
+	etimer_set(&stats_timer, CLOCK_SECOND*INGRESS_STATS_PERIOD);
+
+	while(1) {
+		// Woken up by the timers, or polled when FLUSH_SIZE readings are waiting
+		PROCESS_WAIT_EVENT();
+
+		if (ev == PROCESS_EVENT_POLL || etimer_expired(&flush_timer)) {
+			// Send the buffer one frame at a time, letting the radio run in between
+			while (ingress_count > 0) {
+				ingress_flush_frame();
+				PROCESS_PAUSE();
+			}
+			etimer_restart(&flush_timer);
+		}
+
+		// Events may have been missed while pausing, timers are checked instead
+		if (etimer_expired(&stats_timer)) {
+			ingress_report();
+			etimer_reset(&stats_timer);
+		}
+	}
+
+	PROCESS_END();
 }
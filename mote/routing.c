@@ -15,6 +15,12 @@ const uint8_t DIO = 3;
 const uint8_t DAO = 4;
 const uint8_t DATA = 0;
 const uint8_t OPEN = 1;
+const uint8_t ROUTE_MISS = 5;
+const uint8_t DAO_REQ = 6;
+const uint8_t DAO_AGG = 7;
+const uint8_t DATA_BATCH = 8;
+const uint8_t VALVE = 9;
+const uint8_t CONFIG = 10;
 
 const uint8_t UP = 0;
 const uint8_t DOWN = 1;
@@ -25,6 +31,17 @@ const size_t DIO_size = sizeof(DIO_message_t);
 const size_t DAO_size = sizeof(DAO_message_t);
 const size_t DATA_size = sizeof(DATA_message_t);
 const size_t OPEN_size = sizeof(OPEN_message_t);
+const size_t ROUTE_MISS_size = sizeof(ROUTE_MISS_message_t);
+const size_t DAO_REQ_size = sizeof(DAO_REQ_message_t);
+const size_t DAO_AGG_header_size = sizeof(DAO_AGG_message_t) - MAX_DAO_AGG*sizeof(linkaddr_t);
+const size_t DATA_BATCH_header_size = sizeof(DATA_BATCH_message_t) - MAX_DATA_BATCH*sizeof(DATA_reading_t);
+const size_t VALVE_size = sizeof(VALVE_message_t);
+const size_t CONFIG_size = sizeof(CONFIG_message_t);
+
+// Number of control frames (DIS, DIO, DAO, DAO_REQ) sent since the last statistics report, and among them
+// of DAO frames (DAO and DAO_AGG, sent or forwarded)
+static uint16_t control_frames = 0;
+static uint16_t dao_frames = 0;
 
 
 
@@ -44,12 +61,19 @@ void init_mote(mote_t *mote) {
 	mote->routing_table = hashmap_new();
 
 	if (!mote->routing_table) {
-		printf("init_mote() of mote with address %u.%u : could not allocate enough memory\n", (mote->addr).u8[0], (mote->addr).u8[1]);
+		frame_debug("init_mote() of mote with address %u.%u : could not allocate enough memory\n", (mote->addr).u8[0], (mote->addr).u8[1]);
 		exit(-1);
 	}
 
+	// Initialize neighbour table
+	neighbour_init(mote->neighbours);
+
 	mote->in_dodag = 0;
 	mote->rank = INFINITE_RANK;
+	mote->parent_changes = 0;
+	mote->detach_time = 0;
+	mote->detach_rank = 0;
+	mote->reconvergence = 0;
 
 }
 
@@ -65,7 +89,7 @@ void init_root(mote_t *mote) {
 	mote->routing_table = hashmap_new();
 
 	if (!mote->routing_table) {
-		printf("init_root() of mote with address %u.%u : could not allocate enough memory\n", (mote->addr).u8[0], (mote->addr).u8[1]);
+		frame_debug("init_root() of mote with address %u.%u : could not allocate enough memory\n", (mote->addr).u8[0], (mote->addr).u8[1]);
 		exit(-1);
 	}
 
@@ -90,6 +114,14 @@ void init_parent(mote_t *mote, const linkaddr_t *parent_addr, uint8_t parent_ran
 	mote->in_dodag = 1;
 	mote->rank = parent_rank + 1;
 
+	if (mote->detach_time) {
+		// The mote was repairing its route
+		mote->reconvergence = clock_seconds() - mote->detach_time;
+		mote->detach_time = 0;
+		frame_debug("REPAIR mote %u.%u : re-attached after %lu sec\n",
+			(mote->addr).u8[0], (mote->addr).u8[1], mote->reconvergence);
+	}
+
 }
 
 /**
@@ -108,7 +140,7 @@ uint8_t update_parent(mote_t *mote, uint8_t parent_rank, signed char rss) {
 }
 
 /**
- * Changes the parent of a mote
+ * Changes the parent of a mote, and counts the change in the statistics.
  */
 void change_parent(mote_t *mote, const linkaddr_t *parent_addr, uint8_t parent_rank, signed char rss) {
 
@@ -122,23 +154,87 @@ void change_parent(mote_t *mote, const linkaddr_t *parent_addr, uint8_t parent_r
 	// Update the rank of the mote
 	mote->rank = parent_rank + 1;
 
+	mote->parent_changes++;
+
 }
 
 /**
  * Detaches a mote from the DODAG.
- * Deletes the parent, and sets in_dodag and rank to 0.
- * Restart its routing table.
+ * Deletes the parent, and sets in_dodag to 0 and rank to INFINITE_RANK.
+ * The routing table is kept, to re-announce the subtree if the mote re-attaches within REPAIR_HOLD :
+ * the motes of the subtree heard re-attached through another parent are removed from it (see choose_parent).
+ * A lost parent is counted as a parent change in the statistics.
  */
 void detach(mote_t *mote) {
 	if (mote->in_dodag) { // No need to detach the mote if it isn't already in the DODAG
 		free(mote->parent);
-		hashmap_free(mote->routing_table);
 		mote->in_dodag = 0;
+		mote->detach_rank = mote->rank;
 		mote->rank = INFINITE_RANK;
+		mote->detach_time = clock_seconds();
+		mote->parent_changes++;
+#if !LOCAL_REPAIR
+		flush_routes(mote);
+#endif
+	}
+}
+
+/**
+ * Empties the routing table of a mote, if it is still detached from the DODAG.
+ */
+void flush_routes(mote_t *mote) {
+	if (!mote->in_dodag) {
+		hashmap_free(mote->routing_table);
 		mote->routing_table = hashmap_new();
 	}
 }
 
+/**
+ * Returns 1 if the neighbour can be used as an alternate parent by a mote repairing its route, 0 otherwise.
+ * It must have a reliable link and a lower rank than the mote, not be its lost parent and not be in its subtree.
+ */
+uint8_t is_alternate_parent(mote_t *mote, neighbour_t *neighbour) {
+	linkaddr_t next_hop;
+	return neighbour->in_use
+		&& neighbour_reliable(neighbour)
+		&& neighbour->rank < mote->rank
+		&& !linkaddr_cmp(&(neighbour->addr), &(mote->parent->addr))
+		&& hashmap_get(mote->routing_table, neighbour->addr, &next_hop) != MAP_OK;
+}
+
+/**
+ * Repairs the route of a mote whose parent has been lost, RPL local repair style.
+ * Switches to the best alternate parent of the neighbour table, that has a lower rank
+ * than the mote and isn't in its subtree, and returns PARENT_CHANGED.
+ * If there is no such neighbour, detaches the mote and returns NO_PARENT.
+ */
+int local_repair(mote_t *mote) {
+	// Forget neighbours that may have left as well
+	neighbour_delete_timeout(mote->neighbours);
+
+	neighbour_t *best = NULL;
+	int i;
+	for (i = 0; LOCAL_REPAIR && i < MAX_NB_NEIGHBOURS; i++) {
+		neighbour_t *neighbour = &(mote->neighbours[i]);
+		if (is_alternate_parent(mote, neighbour)
+			&& (!best || neighbour->rank < best->rank
+				|| (neighbour->rank == best->rank && neighbour->rss > best->rss))) {
+			best = neighbour;
+		}
+	}
+
+	if (best) {
+		frame_debug("REPAIR mote %u.%u : switching to alternate parent %u.%u\n",
+			(mote->addr).u8[0], (mote->addr).u8[1], best->addr.u8[0], best->addr.u8[1]);
+		change_parent(mote, &(best->addr), best->rank, neighbour_rss(best));
+		mote->reconvergence = 0;
+		return PARENT_CHANGED;
+	} else {
+		detach(mote);
+		return NO_PARENT;
+	}
+}
+
 /**
  * Broadcasts a DIS message.
  */
@@ -150,6 +246,7 @@ void send_DIS(struct broadcast_conn *conn) {
 	packetbuf_copyfrom((void*) message, DIS_size);
 	free(message);
 	broadcast_send(conn);
+	control_frames++;
 
 }
 
@@ -167,9 +264,51 @@ void send_DIO(struct broadcast_conn *conn, mote_t *mote) {
 	packetbuf_copyfrom((void*) message, DIO_size);
 	free(message);
 	broadcast_send(conn);
+	control_frames++;
 
 }
 
+/**
+ * Callback function that sends the pending DIO answer, unless it has been suppressed.
+ */
+void DIO_response_callback(void *ptr) {
+	DIO_response_t *response = (DIO_response_t*) ptr;
+	response->pending = 0;
+	if (response->mote->in_dodag && response->heard < DIO_REDUNDANCY) {
+		send_DIO(response->conn, response->mote);
+	}
+}
+
+/**
+ * Schedules a DIO answer to a DIS after a random delay.
+ * Does nothing if an answer is already pending, so that a burst of DIS triggers only one DIO.
+ */
+void schedule_DIO_response(DIO_response_t *response, struct broadcast_conn *conn, mote_t *mote) {
+	if (response->pending) {
+		return;
+	}
+	response->pending = 1;
+	response->heard = 0;
+	response->conn = conn;
+	response->mote = mote;
+	ctimer_set(&(response->timer), random_rand() % (CLOCK_SECOND*DIS_RESPONSE_DELAY) + 1,
+		DIO_response_callback, response);
+}
+
+/**
+ * Notifies the pending DIO answer that a DIO with the given rank has been overheard.
+ * The answer is cancelled if DIO_REDUNDANCY neighbours with a rank at least as good already answered.
+ */
+void overheard_DIO(DIO_response_t *response, uint8_t rank) {
+	if (response->pending && rank <= response->mote->rank) {
+		response->heard++;
+		if (response->heard >= DIO_REDUNDANCY) {
+			ctimer_stop(&(response->timer));
+			response->pending = 0;
+		}
+	}
+}
+
 /**
  * Sends a DAO message to the parent of this node.
  */
@@ -183,6 +322,8 @@ void send_DAO(struct runicast_conn *conn, mote_t *mote) {
 	free(message);
 
 	runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+	control_frames++;
+	dao_frames++;
 
 }
 
@@ -190,8 +331,69 @@ void send_DAO(struct runicast_conn *conn, mote_t *mote) {
  * Forwards a DAO message, to the parent of this node.
  */
 void forward_DAO(struct runicast_conn *conn, DAO_message_t *message, mote_t *mote) {
-	packetbuf_copyfrom((void*) message, DAO_size);
+	if (mote->in_dodag) {
+		packetbuf_copyfrom((void*) message, DAO_size);
+		runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+		control_frames++;
+		dao_frames++;
+	}
+}
+
+/**
+ * Sends an aggregated DAO message to the parent of this node, announcing this node and its subtree :
+ * after a detach, the routes kept through REPAIR_HOLD, except the ones of the motes heard re-attached
+ * through another parent in the meantime, that would be overwritten by stale ones.
+ * Sends a simple DAO if there is no route to announce.
+ */
+void send_DAO_subtree(struct runicast_conn *conn, mote_t *mote) {
+	DAO_AGG_message_t *message = (DAO_AGG_message_t*) malloc(sizeof(DAO_AGG_message_t));
+	message->type = DAO_AGG;
+	message->addrs[0] = mote->addr;
+	// Motes that don't fit in the message are announced by their own periodic DAO
+	message->nb = 1 + hashmap_keys(mote->routing_table, message->addrs + 1, MAX_DAO_AGG - 1);
+	if (message->nb == 1) {
+		free(message);
+		send_DAO(conn, mote);
+		return;
+	}
+
+	packetbuf_copyfrom((void*) message, DAO_AGG_header_size + message->nb*sizeof(linkaddr_t));
+	free(message);
+
 	runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+	control_frames++;
+	dao_frames++;
+}
+
+/**
+ * Forwards an aggregated DAO message to the parent of this node.
+ */
+void forward_DAO_AGG(struct runicast_conn *conn, DAO_AGG_message_t *message, mote_t *mote) {
+	if (mote->in_dodag) {
+		packetbuf_copyfrom((void*) message, DAO_AGG_header_size + message->nb*sizeof(linkaddr_t));
+		runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+		control_frames++;
+		dao_frames++;
+	}
+}
+
+/**
+ * Adds the routes announced by an aggregated DAO message, received from the mote with address from.
+ * Returns MAP_NEW if at least one new mote was added to the routing table, MAP_UPDATE if
+ * all motes were already in it, or the error of the routing table.
+ */
+int add_DAO_AGG_routes(hashmap_map *routing_table, DAO_AGG_message_t *message, const linkaddr_t *from) {
+	int ret = MAP_UPDATE;
+	int i;
+	for (i = 0; i < message->nb && i < MAX_DAO_AGG; i++) {
+		int err = hashmap_put(routing_table, message->addrs[i], *from);
+		if (err == MAP_NEW) {
+			ret = MAP_NEW;
+		} else if (err != MAP_UPDATE) {
+			return err;
+		}
+	}
+	return ret;
 }
 
 /**
@@ -209,9 +411,25 @@ uint8_t is_better_parent(mote_t *mote, uint8_t parent_rank, signed char rss) {
 
 /**
  * Selects the parent. Returns a code depending on if the parent has changed or not.
+ * The rss and lqi given to the parent functions are the smoothed metrics of the neighbour table.
  */
-uint8_t choose_parent(mote_t *mote, const linkaddr_t* parent_addr, uint8_t parent_rank, signed char rss) {
-	if (!mote->in_dodag) {
+uint8_t choose_parent(mote_t *mote, const linkaddr_t* parent_addr, uint8_t parent_rank, signed char rss, uint8_t lqi) {
+	linkaddr_t next_hop;
+	if (!mote->in_dodag && parent_rank <= mote->detach_rank) {
+		// Not in the subtree kept after detaching (its motes have a higher rank) : a mote of it re-attached
+		// through another parent, its routes are forgotten so that they aren't re-announced
+		hashmap_remove_routes(mote->routing_table, *parent_addr);
+	}
+	if (parent_rank == INFINITE_RANK) {
+		// Detached mote, it can't be a parent
+		return PARENT_NOT_CHANGED;
+	} else if (lqi < LQI_FLOOR) {
+		// Unreliable link (its frames are often corrupted, whatever its rss), it can't be a parent
+		return PARENT_NOT_CHANGED;
+	} else if (!mote->in_dodag && hashmap_get(mote->routing_table, *parent_addr, &next_hop) == MAP_OK) {
+		// Mote of the subtree kept after detaching, choosing it would create a loop
+		return PARENT_NOT_CHANGED;
+	} else if (!mote->in_dodag) {
 		// Mote not in DODAG yet, initialize parent
 		init_parent(mote, parent_addr, parent_rank, rss);
 		return PARENT_NEW;
@@ -226,19 +444,33 @@ uint8_t choose_parent(mote_t *mote, const linkaddr_t* parent_addr, uint8_t paren
 }
 
 /**
- * Sends a DATA message, containing a random value, to the parent of the mote.
+ * Prints the statistics of the mote (number of parent changes, of sent control frames and of sent DAO frames
+ * during the last STATS_PERIOD, duration of the last repair), and restarts counting.
+ */
+void report_stats(mote_t *mote) {
+	frame_debug("STATS mote %u.%u : %u parent changes, %u control frames, %u DAO, last repair %lu sec, parent rss %d\n",
+		(mote->addr).u8[0], (mote->addr).u8[1], mote->parent_changes, control_frames, dao_frames,
+		mote->reconvergence, mote->in_dodag ? mote->parent->rss : 0);
+	mote->parent_changes = 0;
+	control_frames = 0;
+	dao_frames = 0;
+}
+
+/**
+ * Sends a DATA message, containing the value read by the mote, to the parent of the mote.
+ * Returns 0 if runicast is busy and the message wasn't sent, non-zero otherwise.
  */
-void send_DATA(struct runicast_conn *conn, mote_t *mote) {
+int send_DATA(struct runicast_conn *conn, uint16_t value, mote_t *mote) {
 
 	DATA_message_t *message = (DATA_message_t*) malloc(DATA_size);
 	message->type = DATA;
 	message->src_addr = mote->addr;
-	message->data = (uint16_t) (random_rand() % 501); // US A.Q.I. goes from 0 to 500
+	message->data = value;
 
 	packetbuf_copyfrom((void*) message, DATA_size);
 	free(message);
 
-	runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+	return runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
 }
 
 /**
@@ -249,37 +481,340 @@ void forward_DATA(struct runicast_conn *conn, DATA_message_t *message, mote_t *m
 	runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
 }
 
+/**
+ * Sends a DATA_BATCH message to the parent of the mote, carrying the nb readings values, taken at
+ * times times [sec, clock_seconds()], from the oldest to the newest (at most MAX_DATA_BATCH).
+ * The times are sent relative to the newest reading, itself relative to the sending of the message,
+ * since the motes don't share a clock.
+ * Returns 0 if the mote is detached or runicast is busy and the message wasn't sent, non-zero otherwise.
+ */
+int send_DATA_BATCH(struct runicast_conn *conn, const uint16_t *values, const unsigned long *times, uint8_t nb,
+	mote_t *mote) {
+	if (!mote->in_dodag) {
+		return 0;
+	}
+
+	DATA_BATCH_message_t *message = (DATA_BATCH_message_t*) malloc(sizeof(DATA_BATCH_message_t));
+	message->type = DATA_BATCH;
+	message->nb = nb < MAX_DATA_BATCH ? nb : MAX_DATA_BATCH;
+	message->src_addr = mote->addr;
+	unsigned long newest = times[message->nb - 1];
+	message->age = (uint16_t) (clock_seconds() - newest);
+	uint8_t i;
+	for (i = 0; i < message->nb; i++) {
+		message->readings[i].delta = (uint16_t) (newest - times[i]);
+		message->readings[i].data = values[i];
+	}
+
+	packetbuf_copyfrom((void*) message, DATA_BATCH_header_size + message->nb*sizeof(DATA_reading_t));
+	free(message);
+
+	return runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+}
+
+/**
+ * Forwards a DATA_BATCH message to the parent of the mote, dropping it if the mote is detached.
+ */
+void forward_DATA_BATCH(struct runicast_conn *conn, DATA_BATCH_message_t *message, mote_t *mote) {
+	if (mote->in_dodag) {
+		packetbuf_copyfrom((void*) message, DATA_BATCH_header_size + message->nb*sizeof(DATA_reading_t));
+		runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+	}
+}
+
 /**
  * Sends an OPEN message to the sensor mote with address dst_addr, by sending it
  * to the next-hop address in the routing table.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
  */
-void send_OPEN(struct runicast_conn *conn, linkaddr_t dst_addr, mote_t *mote) {
+int send_OPEN(struct runicast_conn *conn, linkaddr_t dst_addr, mote_t *mote) {
 	// Address of the next-hop mote towards destination
 	linkaddr_t next_hop;
 	if (hashmap_get(mote->routing_table, dst_addr, &next_hop) == MAP_OK) {
 		// Node is correctly in the routing table
 		OPEN_message_t* message = (OPEN_message_t*) malloc(OPEN_size);
 		message->type = OPEN;
+		message->src_addr = mote->addr;
 		message->dst_addr = dst_addr;
 		packetbuf_copyfrom((void*) message, OPEN_size);
+		free(message);
 		runicast_send(conn, &next_hop, MAX_RETRANSMISSIONS);
+		return SENT;
 	} else {
 		// Destination mote wasn't present in routing table
-		printf("Mote not in routing table.\n");
+		frame_debug("Mote %u.%u not in routing table.\n", dst_addr.u8[0], dst_addr.u8[1]);
+		return NO_ROUTE;
 	}
 }
 
 /**
  * Forwards an OPEN message to the next hop mote on the path to the destination.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
  */
-void forward_OPEN(struct runicast_conn *conn, OPEN_message_t *message, mote_t *mote) {
+int forward_OPEN(struct runicast_conn *conn, OPEN_message_t *message, mote_t *mote) {
 	// Address of the next-hop mote towards destination
 	linkaddr_t next_hop;
 	if (hashmap_get(mote->routing_table, message->dst_addr, &next_hop) == MAP_OK) {
 		// Forward to next_hop
 		packetbuf_copyfrom((void*) message, OPEN_size);
 		runicast_send(conn, &next_hop, MAX_RETRANSMISSIONS);
+		return SENT;
+	} else {
+		frame_debug("Error in forwarding OPEN message to mote %u.%u : no route.\n",
+			message->dst_addr.u8[0], message->dst_addr.u8[1]);
+		return NO_ROUTE;
+	}
+}
+
+/**
+ * Sends a ROUTE_MISS message about an OPEN or CONFIG message (msg_type), from src_addr to dst_addr, that
+ * couldn't be forwarded, towards the origin of the message (through the parent of the mote).
+ */
+void send_ROUTE_MISS(struct runicast_conn *conn, linkaddr_t src_addr, linkaddr_t dst_addr, uint8_t msg_type, mote_t *mote) {
+	if (!mote->in_dodag) {
+		return;
+	}
+
+	ROUTE_MISS_message_t *route_miss = (ROUTE_MISS_message_t*) malloc(ROUTE_MISS_size);
+	route_miss->type = ROUTE_MISS;
+	route_miss->src_addr = src_addr;
+	route_miss->dst_addr = dst_addr;
+	route_miss->msg_type = msg_type;
+
+	packetbuf_copyfrom((void*) route_miss, ROUTE_MISS_size);
+	free(route_miss);
+
+	runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+}
+
+/**
+ * Forwards a ROUTE_MISS message to the parent of the mote.
+ */
+void forward_ROUTE_MISS(struct runicast_conn *conn, ROUTE_MISS_message_t *message, mote_t *mote) {
+	if (mote->in_dodag) {
+		packetbuf_copyfrom((void*) message, ROUTE_MISS_size);
+		runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+	}
+}
+
+/**
+ * Sends a VALVE message to the parent of the mote, telling that the mote opened its valve for the given slope.
+ */
+void send_VALVE(struct runicast_conn *conn, int16_t slope, mote_t *mote) {
+
+	VALVE_message_t *message = (VALVE_message_t*) malloc(VALVE_size);
+	message->type = VALVE;
+	message->src_addr = mote->addr;
+	message->slope = slope;
+
+	packetbuf_copyfrom((void*) message, VALVE_size);
+	free(message);
+
+	runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+}
+
+/**
+ * Forwards a VALVE message to the parent of the mote.
+ */
+void forward_VALVE(struct runicast_conn *conn, VALVE_message_t *message, mote_t *mote) {
+	if (mote->in_dodag) {
+		packetbuf_copyfrom((void*) message, VALVE_size);
+		runicast_send(conn, &(mote->parent->addr), MAX_RETRANSMISSIONS);
+	}
+}
+
+/**
+ * Sends a CONFIG message, setting the threshold of the autonomous valve of the sensor mote with address dst_addr,
+ * to the next-hop address in the routing table.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
+ */
+int send_CONFIG(struct runicast_conn *conn, linkaddr_t dst_addr, int16_t threshold, mote_t *mote) {
+	// Address of the next-hop mote towards destination
+	linkaddr_t next_hop;
+	if (hashmap_get(mote->routing_table, dst_addr, &next_hop) == MAP_OK) {
+		CONFIG_message_t* message = (CONFIG_message_t*) malloc(CONFIG_size);
+		message->type = CONFIG;
+		message->src_addr = mote->addr;
+		message->dst_addr = dst_addr;
+		message->threshold = threshold;
+		packetbuf_copyfrom((void*) message, CONFIG_size);
+		free(message);
+		runicast_send(conn, &next_hop, MAX_RETRANSMISSIONS);
+		return SENT;
 	} else {
-		printf("Error in forwarding OPEN message.\n");
+		frame_debug("Mote %u.%u not in routing table.\n", dst_addr.u8[0], dst_addr.u8[1]);
+		return NO_ROUTE;
+	}
+}
+
+/**
+ * Forwards a CONFIG message to the next hop mote on the path to the destination.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
+ */
+int forward_CONFIG(struct runicast_conn *conn, CONFIG_message_t *message, mote_t *mote) {
+	// Address of the next-hop mote towards destination
+	linkaddr_t next_hop;
+	if (hashmap_get(mote->routing_table, message->dst_addr, &next_hop) == MAP_OK) {
+		packetbuf_copyfrom((void*) message, CONFIG_size);
+		runicast_send(conn, &next_hop, MAX_RETRANSMISSIONS);
+		return SENT;
+	} else {
+		frame_debug("Error in forwarding CONFIG message to mote %u.%u : no route.\n",
+			message->dst_addr.u8[0], message->dst_addr.u8[1]);
+		return NO_ROUTE;
+	}
+}
+
+/**
+ * Broadcasts a DAO_REQ message, asking for a fresh DAO about the mote with address dst_addr.
+ */
+void send_DAO_REQ(struct broadcast_conn *conn, linkaddr_t dst_addr) {
+
+	DAO_REQ_message_t *message = (DAO_REQ_message_t*) malloc(DAO_REQ_size);
+	message->type = DAO_REQ;
+	message->dst_addr = dst_addr;
+
+	packetbuf_copyfrom((void*) message, DAO_REQ_size);
+	free(message);
+	broadcast_send(conn);
+	control_frames++;
+
+}
+
+/**
+ * Forwards a DAO_REQ message to the next hop mote on the path to the requested mote.
+ * Returns SENT, or NO_ROUTE if the requested mote isn't in the routing table.
+ */
+int forward_DAO_REQ(struct runicast_conn *conn, DAO_REQ_message_t *message, mote_t *mote) {
+	// Address of the next-hop mote towards the requested mote
+	linkaddr_t next_hop;
+	if (hashmap_get(mote->routing_table, message->dst_addr, &next_hop) == MAP_OK) {
+		packetbuf_copyfrom((void*) message, DAO_REQ_size);
+		runicast_send(conn, &next_hop, MAX_RETRANSMISSIONS);
+		control_frames++;
+		return SENT;
+	}
+	return NO_ROUTE;
+}
+
+/**
+ * Answers a DAO_REQ message broadcast by the mote with address from.
+ * The requested mote sends a DAO, and a child of the requesting mote that has a route
+ * towards the requested mote forwards the request along this route. Other motes ignore the request.
+ */
+void answer_DAO_REQ(struct runicast_conn *conn, DAO_REQ_message_t *message, const linkaddr_t *from, mote_t *mote) {
+	if (!mote->in_dodag) {
+		return;
+	}
+
+	if (linkaddr_cmp(&(message->dst_addr), &(mote->addr))) {
+		// This is the requested mote
+		send_DAO(conn, mote);
+	} else if (linkaddr_cmp(from, &(mote->parent->addr))) {
+		// The requested mote may be in the subtree of this mote : the route may be stale too,
+		// only the requested mote itself refreshes the routes of its ancestors
+		forward_DAO_REQ(conn, message, mote);
+	}
+}
+
+/**
+ * Handles a DAO_REQ message unicast along the path towards the requested mote.
+ * The requested mote sends a DAO, a mote with a route forwards the request, and the mote at the end
+ * of the known path (without route) broadcasts it to its neighbours.
+ */
+void route_DAO_REQ(struct runicast_conn *conn, struct broadcast_conn *bconn, DAO_REQ_message_t *message,
+	mote_t *mote) {
+	if (!mote->in_dodag) {
+		return;
+	}
+
+	if (linkaddr_cmp(&(message->dst_addr), &(mote->addr))) {
+		send_DAO(conn, mote);
+	} else if (forward_DAO_REQ(conn, message, mote) == NO_ROUTE) {
+		send_DAO_REQ(bconn, message->dst_addr);
+	}
+}
+
+/**
+ * Initializes an empty buffer of OPEN messages waiting to be retried.
+ */
+void init_pending_OPEN(pending_OPEN_t pending[]) {
+	int i;
+	for (i = 0; i < MAX_PENDING_OPEN; i++) {
+		pending[i].in_use = 0;
+	}
+}
+
+void OPEN_retry_callback(void *ptr);
+
+/**
+ * Schedules a new attempt of a pending OPEN message,
+ * or gives up if it has already been retried MAX_OPEN_RETRIES times.
+ */
+void schedule_OPEN_retry(pending_OPEN_t *pending) {
+	if (pending->retries >= MAX_OPEN_RETRIES) {
+		frame_debug("OPEN to mote %u.%u failed after %u retries\n",
+			pending->dst_addr.u8[0], pending->dst_addr.u8[1], pending->retries);
+		pending->in_use = 0;
+		return;
+	}
+	pending->retries++;
+	pending->timestamp = clock_seconds();
+	ctimer_set(&(pending->timer), CLOCK_SECOND*OPEN_RETRY_DELAY, OPEN_retry_callback, pending);
+}
+
+/**
+ * Callback function that sends a pending OPEN message again.
+ * The message stays pending for TIMEOUT_PENDING_OPEN seconds, to count the retries
+ * if another route miss comes back.
+ */
+void OPEN_retry_callback(void *ptr) {
+	pending_OPEN_t *pending = (pending_OPEN_t*) ptr;
+	if (send_OPEN(pending->conn, pending->dst_addr, pending->mote) == SENT) {
+		frame_debug("OPEN to mote %u.%u retried (%u/%u)\n",
+			pending->dst_addr.u8[0], pending->dst_addr.u8[1], pending->retries, MAX_OPEN_RETRIES);
+		pending->timestamp = clock_seconds();
+	} else {
+		schedule_OPEN_retry(pending);
+	}
+}
+
+/**
+ * Handles a route miss for an OPEN message originated by this mote, towards dst_addr.
+ * The OPEN message is sent again after OPEN_RETRY_DELAY seconds, at most MAX_OPEN_RETRIES times.
+ */
+void OPEN_route_miss(pending_OPEN_t pending[], struct runicast_conn *conn, linkaddr_t dst_addr, mote_t *mote) {
+	unsigned long time = clock_seconds();
+	pending_OPEN_t *entry = NULL;
+	int i;
+	for (i = 0; i < MAX_PENDING_OPEN; i++) {
+		if (pending[i].in_use && ctimer_expired(&(pending[i].timer))
+			&& time > pending[i].timestamp + TIMEOUT_PENDING_OPEN) {
+			// Last attempt didn't come back, it has been delivered
+			pending[i].in_use = 0;
+		}
+		if (pending[i].in_use && linkaddr_cmp(&dst_addr, &(pending[i].dst_addr))) {
+			entry = &(pending[i]);
+			break;
+		} else if (!pending[i].in_use && !entry) {
+			entry = &(pending[i]);
+		}
+	}
+
+	if (!entry) {
+		frame_debug("OPEN to mote %u.%u failed : too many pending OPEN messages\n", dst_addr.u8[0], dst_addr.u8[1]);
+		return;
+	}
+
+	if (!entry->in_use) {
+		entry->in_use = 1;
+		entry->dst_addr = dst_addr;
+		entry->retries = 0;
+		entry->conn = conn;
+		entry->mote = mote;
+	} else if (!ctimer_expired(&(entry->timer))) {
+		// A retry is already scheduled
+		return;
 	}
+	schedule_OPEN_retry(entry);
 }
@@ -13,6 +13,8 @@
 #include "random.h"
 
 #include "hashmap.h"
+#include "neighbour-table.h"
+#include "serial-frame.h"
 
 
 ///////////////////
@@ -26,6 +28,7 @@
 #define SENT       1
 #define NOT_SENT  -1
 #define NO_PARENT -2
+#define NO_ROUTE  -3
 
 // Return values for choose_parent function
 #define PARENT_NOT_CHANGED  0
@@ -41,6 +44,46 @@
 // Timeout value to detach from unresponsive parent
 #define TIMEOUT_PARENT 50
 
+// Maximum random delay [sec] before answering a DIS with a DIO
+#define DIS_RESPONSE_DELAY 1
+
+// Number of overheard DIOs (with a rank at least as good as ours) that suppress our answer to a DIS
+#define DIO_REDUNDANCY 2
+
+// Period [sec] of the statistics reports (parent changes and control frames are counted per period)
+#define STATS_PERIOD 3600
+
+// Time [sec] during which a detached mote keeps its routing table, to re-announce its subtree
+#define REPAIR_HOLD 30
+
+// 1 : a mote that lost its parent switches to an alternate parent, or keeps its routing table for REPAIR_HOLD
+// seconds (local repair). 0 : it detaches and empties its routing table at once, to measure the difference
+#ifndef LOCAL_REPAIR
+#define LOCAL_REPAIR 1
+#endif
+
+// Maximum number of addresses in an aggregated DAO message
+#define MAX_DAO_AGG 32
+
+// Maximum number of readings in a DATA_BATCH message
+#define MAX_DATA_BATCH 16
+
+// Threshold of a CONFIG message that disables the autonomous valve of a sensor mote
+#define LOCAL_DISABLED 0x7FFF
+
+// Delay [sec] before retrying an OPEN message that hit a missing route
+#define OPEN_RETRY_DELAY 5
+
+// Maximum number of retries of an OPEN message that hit a missing route
+#define MAX_OPEN_RETRIES 3
+
+// Maximum number of OPEN messages a mote keeps for retrying
+#define MAX_PENDING_OPEN 4
+
+// Timeout value [sec] after which a retried OPEN message is considered delivered : the destination doesn't
+// acknowledge it, only a ROUTE_MISS coming back within this time tells that it was lost
+#define TIMEOUT_PENDING_OPEN 30
+
 
 // Values for the different types of messages
 const uint8_t DIS;
@@ -48,6 +91,12 @@ const uint8_t DIO;
 const uint8_t DAO;
 const uint8_t DATA;
 const uint8_t OPEN;
+const uint8_t ROUTE_MISS;
+const uint8_t DAO_REQ;
+const uint8_t DAO_AGG;
+const uint8_t DATA_BATCH;
+const uint8_t VALVE;
+const uint8_t CONFIG;
 
 const uint8_t UP;
 const uint8_t DOWN;
@@ -58,6 +107,12 @@ const size_t DIO_size;
 const size_t DAO_size;
 const size_t DATA_size;
 const size_t OPEN_size;
+const size_t ROUTE_MISS_size;
+const size_t DAO_REQ_size;
+const size_t DAO_AGG_header_size;
+const size_t DATA_BATCH_header_size;
+const size_t VALVE_size;
+const size_t CONFIG_size;
 
 
 
@@ -80,8 +135,23 @@ typedef struct mote {
 	uint8_t rank;
 	parent_t* parent;
 	hashmap_map* routing_table;
+	neighbour_t neighbours[MAX_NB_NEIGHBOURS];
+	uint16_t parent_changes;
+	unsigned long detach_time; // 0 if the mote isn't repairing its route
+	uint8_t detach_rank; // rank of the mote when it detached, the motes of its subtree having a higher one
+	unsigned long reconvergence; // duration [sec] of the last repair
 } mote_t;
 
+// Represents a pending DIO answer to a DIS, sent after a random delay unless
+// enough neighbours have already answered in the meantime
+typedef struct DIO_response {
+	struct ctimer timer;
+	uint8_t pending;
+	uint8_t heard;
+	struct broadcast_conn *conn;
+	mote_t *mote;
+} DIO_response_t;
+
 
 // Represents a DIS control message
 typedef struct DIS_message {
@@ -100,6 +170,14 @@ typedef struct DAO_message {
 	linkaddr_t src_addr;
 } DAO_message_t;
 
+// Represents an aggregated DAO message, that announces a mote and its whole subtree
+// Only the first nb addresses are sent
+typedef struct DAO_AGG_message {
+	uint8_t type;
+	uint8_t nb;
+	linkaddr_t addrs[MAX_DAO_AGG];
+} DAO_AGG_message_t;
+
 // Represents a DATA message, that carries the data from a sensor mote to the server
 typedef struct DATA_message {
 	uint8_t type;
@@ -107,12 +185,71 @@ typedef struct DATA_message {
 	uint16_t data;
 } DATA_message_t;
 
+// Represents a reading of a DATA_BATCH message
+typedef struct DATA_reading {
+	uint16_t delta; // time [sec] between the reading and the newest reading of the message
+	uint16_t data;
+} DATA_reading_t;
+
+// Represents a DATA_BATCH message, that carries the last readings of a sensor mote to the server,
+// from the oldest to the newest. Only the first nb readings are sent
+typedef struct DATA_BATCH_message {
+	uint8_t type;
+	uint8_t nb;
+	linkaddr_t src_addr;
+	uint16_t age; // time [sec] between the newest reading and the sending of the message
+	DATA_reading_t readings[MAX_DATA_BATCH];
+} DATA_BATCH_message_t;
+
 // Represents a OPEN message, that tells to a mote to open its valve
 typedef struct OPEN_message {
 	uint8_t type;
+	linkaddr_t src_addr; // mote that decided to open the valve (root or computation mote)
 	linkaddr_t dst_addr;
 } OPEN_message_t;
 
+// Represents a VALVE message, that tells the server that a sensor mote opened its valve by itself
+typedef struct VALVE_message {
+	uint8_t type;
+	linkaddr_t src_addr;
+	int16_t slope; // slope [centi-A.Q.I. per minute] that decided the opening
+} VALVE_message_t;
+
+// Represents a CONFIG message, that sets the threshold of the autonomous valve of a sensor mote
+typedef struct CONFIG_message {
+	uint8_t type;
+	linkaddr_t src_addr; // origin of the message (root)
+	linkaddr_t dst_addr;
+	int16_t threshold; // slope [centi-A.Q.I. per minute] over which the valve opens, LOCAL_DISABLED : never
+} CONFIG_message_t;
+
+// Represents a ROUTE_MISS message, sent back to the origin of an OPEN (or CONFIG) message
+// when a mote on the path has no route towards the destination
+typedef struct ROUTE_MISS_message {
+	uint8_t type;
+	linkaddr_t src_addr; // origin of the OPEN message
+	linkaddr_t dst_addr; // destination of the OPEN message
+	uint8_t msg_type; // type of the message that couldn't be forwarded (OPEN or CONFIG)
+} ROUTE_MISS_message_t;
+
+// Represents a DAO_REQ message, asking for a fresh DAO about a destination : broadcast by a mote without route,
+// and unicast along the known path towards the destination
+typedef struct DAO_REQ_message {
+	uint8_t type;
+	linkaddr_t dst_addr;
+} DAO_REQ_message_t;
+
+// Represents an OPEN message waiting to be retried by its origin, after a route miss
+typedef struct pending_OPEN {
+	struct ctimer timer;
+	linkaddr_t dst_addr;
+	uint8_t in_use;
+	uint8_t retries;
+	unsigned long timestamp;
+	struct runicast_conn *conn;
+	mote_t *mote;
+} pending_OPEN_t;
+
 
 
 ///////////////////
@@ -141,16 +278,31 @@ void init_parent(mote_t *mote, const linkaddr_t *parent_addr, uint8_t parent_ran
 uint8_t update_parent(mote_t *mote, uint8_t parent_rank, signed char rss);
 
 /**
- * Changes the parent of a mote.
+ * Changes the parent of a mote, and counts the change in the statistics.
  */
 void change_parent(mote_t *mote, const linkaddr_t *parent_addr, uint8_t parent_rank, signed char rss);
 
 /**
  * Detaches a mote from the DODAG.
- * Deletes the parent, and sets in_dodag and rank to 0.
+ * Deletes the parent, and sets in_dodag to 0 and rank to INFINITE_RANK.
+ * The routing table is kept, to re-announce the subtree if the mote re-attaches quickly.
+ * A lost parent is counted as a parent change in the statistics.
  */
 void detach(mote_t *mote);
 
+/**
+ * Empties the routing table of a mote, if it is still detached from the DODAG.
+ */
+void flush_routes(mote_t *mote);
+
+/**
+ * Repairs the route of a mote whose parent has been lost, RPL local repair style.
+ * Switches to the best alternate parent of the neighbour table, that has a lower rank
+ * than the mote and isn't in its subtree, and returns PARENT_CHANGED.
+ * If there is no such neighbour, detaches the mote and returns NO_PARENT.
+ */
+int local_repair(mote_t *mote);
+
 /**
  * Broadcasts a DIS message.
  */
@@ -161,6 +313,18 @@ void send_DIS(struct broadcast_conn *conn);
  */
 void send_DIO(struct broadcast_conn *conn, mote_t *mote);
 
+/**
+ * Schedules a DIO answer to a DIS after a random delay.
+ * Does nothing if an answer is already pending, so that a burst of DIS triggers only one DIO.
+ */
+void schedule_DIO_response(DIO_response_t *response, struct broadcast_conn *conn, mote_t *mote);
+
+/**
+ * Notifies the pending DIO answer that a DIO with the given rank has been overheard.
+ * The answer is cancelled if DIO_REDUNDANCY neighbours with a rank at least as good already answered.
+ */
+void overheard_DIO(DIO_response_t *response, uint8_t rank);
+
 /**
  * Sends a DAO message to the parent of this node.
  */
@@ -172,27 +336,143 @@ void send_DAO(struct runicast_conn *conn, mote_t *mote);
 void forward_DAO(struct runicast_conn *conn, DAO_message_t *message, mote_t *mote);
 
 /**
- * Selects the parent, if it has a lower rank and a better rss
+ * Sends an aggregated DAO message to the parent of this node, announcing this node and its subtree.
+ * Sends a simple DAO if the subtree is empty.
+ */
+void send_DAO_subtree(struct runicast_conn *conn, mote_t *mote);
+
+/**
+ * Forwards an aggregated DAO message to the parent of this node.
+ */
+void forward_DAO_AGG(struct runicast_conn *conn, DAO_AGG_message_t *message, mote_t *mote);
+
+/**
+ * Adds the routes announced by an aggregated DAO message, received from the mote with address from.
+ * Returns MAP_NEW if at least one new mote was added to the routing table, MAP_UPDATE if
+ * all motes were already in it, or the error of the routing table.
  */
-uint8_t choose_parent(mote_t *mote, const linkaddr_t* parent_addr, uint8_t parent_rank, signed char rss);
+int add_DAO_AGG_routes(hashmap_map *routing_table, DAO_AGG_message_t *message, const linkaddr_t *from);
 
 /**
- * Sends a DATA message, containing a random value, to the parent of the mote.
+ * Selects the parent, if it has a lower rank and a better rss.
+ * The rss and lqi given to the parent functions are the smoothed metrics of the neighbour table.
+ * Detached motes, motes of the subtree still kept by a detached mote, and motes with an lqi below
+ * LQI_FLOOR are never selected.
  */
-void send_DATA(struct runicast_conn *conn, mote_t *mote);
+uint8_t choose_parent(mote_t *mote, const linkaddr_t* parent_addr, uint8_t parent_rank, signed char rss, uint8_t lqi);
+
+/**
+ * Prints the statistics of the mote (number of parent changes, of sent control frames and of sent DAO frames
+ * during the last STATS_PERIOD, duration of the last repair), and restarts counting.
+ */
+void report_stats(mote_t *mote);
+
+/**
+ * Sends a DATA message, containing the value read by the mote, to the parent of the mote.
+ * Returns 0 if runicast is busy and the message wasn't sent, non-zero otherwise.
+ */
+int send_DATA(struct runicast_conn *conn, uint16_t value, mote_t *mote);
 
 /**
  * Forwards a DATA message to the parent of the mote.
  */
 void forward_DATA(struct runicast_conn *conn, DATA_message_t *message, mote_t *mote);
 
+/**
+ * Sends a DATA_BATCH message to the parent of the mote, carrying the nb readings values, taken at
+ * times times [sec, clock_seconds()], from the oldest to the newest (at most MAX_DATA_BATCH).
+ * Returns 0 if the mote is detached or runicast is busy and the message wasn't sent, non-zero otherwise.
+ */
+int send_DATA_BATCH(struct runicast_conn *conn, const uint16_t *values, const unsigned long *times, uint8_t nb,
+	mote_t *mote);
+
+/**
+ * Forwards a DATA_BATCH message to the parent of the mote, dropping it if the mote is detached.
+ */
+void forward_DATA_BATCH(struct runicast_conn *conn, DATA_BATCH_message_t *message, mote_t *mote);
+
 /**
  * Sends an OPEN message to the sensor mote with address dst_addr, by sending it
  * to the next-hop address in the routing table.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
  */
-void send_OPEN(struct runicast_conn *conn, linkaddr_t dst_addr, mote_t *mote);
+int send_OPEN(struct runicast_conn *conn, linkaddr_t dst_addr, mote_t *mote);
 
 /**
  * Forwards an OPEN message to the next hop mote on the path to the destination.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
+ */
+int forward_OPEN(struct runicast_conn *conn, OPEN_message_t *message, mote_t *mote);
+
+/**
+ * Sends a ROUTE_MISS message about an OPEN or CONFIG message (msg_type), from src_addr to dst_addr, that
+ * couldn't be forwarded, towards the origin of the message (through the parent of the mote).
+ */
+void send_ROUTE_MISS(struct runicast_conn *conn, linkaddr_t src_addr, linkaddr_t dst_addr, uint8_t msg_type, mote_t *mote);
+
+/**
+ * Forwards a ROUTE_MISS message to the parent of the mote.
+ */
+void forward_ROUTE_MISS(struct runicast_conn *conn, ROUTE_MISS_message_t *message, mote_t *mote);
+
+/**
+ * Sends a VALVE message to the parent of the mote, telling that the mote opened its valve for the given slope.
+ */
+void send_VALVE(struct runicast_conn *conn, int16_t slope, mote_t *mote);
+
+/**
+ * Forwards a VALVE message to the parent of the mote.
+ */
+void forward_VALVE(struct runicast_conn *conn, VALVE_message_t *message, mote_t *mote);
+
+/**
+ * Sends a CONFIG message, setting the threshold of the autonomous valve of the sensor mote with address dst_addr,
+ * to the next-hop address in the routing table.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
+ */
+int send_CONFIG(struct runicast_conn *conn, linkaddr_t dst_addr, int16_t threshold, mote_t *mote);
+
+/**
+ * Forwards a CONFIG message to the next hop mote on the path to the destination.
+ * Returns SENT, or NO_ROUTE if the destination isn't in the routing table.
+ */
+int forward_CONFIG(struct runicast_conn *conn, CONFIG_message_t *message, mote_t *mote);
+
+/**
+ * Broadcasts a DAO_REQ message, asking for a fresh DAO about the mote with address dst_addr.
+ */
+void send_DAO_REQ(struct broadcast_conn *conn, linkaddr_t dst_addr);
+
+/**
+ * Forwards a DAO_REQ message to the next hop mote on the path to the requested mote.
+ * Returns SENT, or NO_ROUTE if the requested mote isn't in the routing table.
+ */
+int forward_DAO_REQ(struct runicast_conn *conn, DAO_REQ_message_t *message, mote_t *mote);
+
+/**
+ * Answers a DAO_REQ message broadcast by the mote with address from.
+ * The requested mote sends a DAO, and a child of the requesting mote that has a route
+ * towards the requested mote forwards the request along this route. Other motes ignore the request.
+ */
+void answer_DAO_REQ(struct runicast_conn *conn, DAO_REQ_message_t *message, const linkaddr_t *from, mote_t *mote);
+
+/**
+ * Handles a DAO_REQ message unicast along the path towards the requested mote.
+ * The requested mote sends a DAO, a mote with a route forwards the request, and the mote at the end
+ * of the known path (without route) broadcasts it to its neighbours.
+ */
+void route_DAO_REQ(struct runicast_conn *conn, struct broadcast_conn *bconn, DAO_REQ_message_t *message,
+	mote_t *mote);
+
+/**
+ * Initializes an empty buffer of OPEN messages waiting to be retried.
+ */
+void init_pending_OPEN(pending_OPEN_t pending[]);
+
+/**
+ * Handles a route miss for an OPEN message originated by this mote, towards dst_addr.
+ * The OPEN message is sent again after OPEN_RETRY_DELAY seconds, at most MAX_OPEN_RETRIES times.
+ * The delivery is not confirmed by the destination : an OPEN without ROUTE_MISS for TIMEOUT_PENDING_OPEN
+ * seconds is assumed delivered, even if a runicast deeper in the path timed out.
  */
-void forward_OPEN(struct runicast_conn *conn, OPEN_message_t *message, mote_t *mote);
+void OPEN_route_miss(pending_OPEN_t pending[], struct runicast_conn *conn, linkaddr_t dst_addr, mote_t *mote);
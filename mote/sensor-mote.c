@@ -6,7 +6,7 @@
 #include "net/rime/rime.h"
 #include "dev/leds.h"
 
-#include "routing.h"
+#include "computation.h" // routing, and TIMEOUT_DATA of the computation motes
 #include "trickle-timer.h"
 
 #include <stdio.h>
@@ -19,6 +19,44 @@
 // Duration of the opening of the valve [sec]
 #define OPEN_TIME 600
 
+// Number of readings sent together in a DATA_BATCH message (1 : each reading is sent in its own DATA message)
+#ifndef BATCH_SIZE
+#define BATCH_SIZE 1
+#endif
+
+// Maximum time [sec] a reading waits on the mote before being sent, when the readings are batched
+#ifndef BATCH_LATENCY
+#define BATCH_LATENCY 300
+#endif
+
+// Send-on-delta reporting : a reading is only sent if it differs by REPORT_DELTA [A.Q.I.] from the last sent one,
+// if the trend of the readings changes its sign, or if no reading was sent for HEARTBEAT_PERIOD [sec]
+// (plus one DATA_PERIOD, lower than TIMEOUT_DATA of the computation motes). 0 : every reading is sent
+#ifndef REPORT_DELTA
+#define REPORT_DELTA 0
+#endif
+#define HEARTBEAT_PERIOD 180
+
+// The computation motes must not forget the mote between two of its messages
+#if BATCH_SIZE > 1 && BATCH_LATENCY + 2*DATA_PERIOD > TIMEOUT_DATA
+#error "TIMEOUT_DATA must exceed BATCH_LATENCY + DATA_PERIOD by one DATA_PERIOD at least"
+#endif
+#if REPORT_DELTA > 0 && HEARTBEAT_PERIOD + 2*DATA_PERIOD > TIMEOUT_DATA
+#error "TIMEOUT_DATA must exceed HEARTBEAT_PERIOD + DATA_PERIOD by one DATA_PERIOD at least"
+#endif
+
+// Autonomous valve : slope [centi-A.Q.I. per minute] of the last LOCAL_WINDOW readings over which the mote opens
+// its valve itself, and reports it to the server. LOCAL_DISABLED : only OPEN messages open the valve.
+// The threshold can be changed by CONFIG messages of the server
+#ifndef LOCAL_THRESHOLD
+#define LOCAL_THRESHOLD LOCAL_DISABLED
+#endif
+#define LOCAL_WINDOW 10
+
+#if BATCH_SIZE < 1 || BATCH_SIZE > MAX_DATA_BATCH
+#error "BATCH_SIZE must be between 1 and MAX_DATA_BATCH"
+#endif
+
 
 // Represents the attributes of this mote
 mote_t mote;
@@ -29,6 +67,9 @@ uint8_t created = 0;
 // Trickle timer for the periodic messages
 trickle_timer_t t_timer;
 
+// Pending DIO answer to received DIS messages
+DIO_response_t DIO_response;
+
 // Broadcast connection
 static struct broadcast_conn broadcast;
 
@@ -53,12 +94,181 @@ struct ctimer parent_timer;
 // Callback timer to delete unresponsive children
 struct ctimer children_timer;
 
+// Callback timer to report the statistics
+struct ctimer stats_timer;
+
+// Callback timer to forget the subtree if the mote doesn't re-attach quickly
+struct ctimer repair_timer;
+
 // Callback timer to send data
 struct ctimer data_timer;
 
 // Callback timer to open the valve
 struct ctimer open_timer;
 
+// Readings waiting to be sent in a DATA_BATCH message, from the oldest to the newest, and their times [sec]
+static uint16_t batch_values[BATCH_SIZE];
+static unsigned long batch_times[BATCH_SIZE];
+static uint8_t batch_count = 0;
+
+// Last sent reading and its time [sec], and sign of the change between the two last sent readings (-1, 0 or 1)
+static uint16_t last_sent_value = 0;
+static unsigned long last_sent_time = 0;
+static uint8_t sent_once = 0;
+static int8_t sent_trend = 0;
+
+/**
+ * Returns the air quality measured by the sensor (simulated : uniform random value).
+ */
+uint16_t read_air_quality() {
+	return (uint16_t) (random_rand() % 501); // US A.Q.I. goes from 0 to 500
+}
+
+/**
+ * Returns 1 if a reading must be sent (send-on-delta), 0 if it can be skipped : when it differs from the last
+ * sent reading by at least REPORT_DELTA, when the trend turns (the reading moved by half of REPORT_DELTA
+ * against the direction of the last sent change, noise below it being ignored), or for the heartbeat.
+ * The reading is only recorded as sent by report_sent.
+ */
+uint8_t must_report(uint16_t value, unsigned long time) {
+	int diff = (int) value - (int) last_sent_value;
+	int half = (REPORT_DELTA + 1) / 2;
+	int8_t trend = diff >= half ? 1 : (diff <= -half ? -1 : 0);
+
+	return REPORT_DELTA == 0 || !sent_once || time - last_sent_time >= HEARTBEAT_PERIOD
+		|| diff >= REPORT_DELTA || diff <= -REPORT_DELTA || (trend != 0 && trend == -sent_trend);
+}
+
+/**
+ * Records a reading as sent, once its message was accepted by runicast (or its batch queued).
+ * The trend only follows changes of at least half of REPORT_DELTA, the noise of a heartbeat being ignored.
+ */
+void report_sent(uint16_t value, unsigned long time) {
+	int diff = (int) value - (int) last_sent_value;
+	int half = (REPORT_DELTA + 1) / 2;
+
+	if (sent_once && diff != 0 && (diff >= half || diff <= -half)) {
+		sent_trend = diff > 0 ? 1 : -1;
+	}
+	last_sent_value = value;
+	last_sent_time = time;
+	sent_once = 1;
+}
+
+// Last LOCAL_WINDOW readings (circular buffer) and their times [sec], for the autonomous valve
+static uint16_t local_values[LOCAL_WINDOW];
+static unsigned long local_times[LOCAL_WINDOW];
+static uint8_t local_first = 0;
+static uint8_t local_count = 0;
+static int16_t local_threshold = LOCAL_THRESHOLD;
+
+// 1 if the valve is open, and slope of the opening not reported yet to the server (runicast being busy)
+static uint8_t valve_open = 0;
+static uint8_t valve_report_pending = 0;
+static int16_t valve_report_slope = 0;
+
+/**
+ * Adds a reading to the window of the autonomous valve, replacing the oldest one if it is full.
+ */
+void local_add(uint16_t value, unsigned long time) {
+	uint8_t i = (local_first + local_count) % LOCAL_WINDOW;
+	if (local_count == LOCAL_WINDOW) {
+		local_first = (local_first + 1) % LOCAL_WINDOW;
+	} else {
+		local_count++;
+	}
+	local_values[i] = value;
+	local_times[i] = time;
+}
+
+/**
+ * Returns the slope [centi-A.Q.I. per minute] of the least square regression of the readings of the window,
+ * in fixed point (no floating point on the mote) : the sums fit in 32 bits for LOCAL_WINDOW readings spanning
+ * less than an hour, only the final scaling needs 64 bits.
+ */
+int16_t local_slope() {
+	int32_t sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0;
+	int32_t n = local_count;
+	uint8_t i;
+	for (i = 0; i < local_count; i++) {
+		uint8_t j = (local_first + i) % LOCAL_WINDOW;
+		int32_t x = (int32_t) (local_times[j] - local_times[local_first]); // seconds since the oldest reading
+		int32_t y = local_values[j];
+		sum_x += x;
+		sum_y += y;
+		sum_xx += x * x;
+		sum_xy += x * y;
+	}
+	int32_t denominator = n * sum_xx - sum_x * sum_x;
+	if (denominator == 0) {
+		return 0;
+	}
+	int64_t slope = (int64_t) (n * sum_xy - sum_x * sum_y) * 6000 / denominator; // per second -> centi per minute
+	if (slope > INT16_MAX - 1) {
+		return INT16_MAX - 1;
+	} else if (slope < INT16_MIN) {
+		return INT16_MIN;
+	}
+	return (int16_t) slope;
+}
+
+/**
+ * Sends the pending report of an opening of the valve to the server, if runicast is free.
+ */
+void valve_report() {
+	if (valve_report_pending && mote.in_dodag && !runicast_is_transmitting(&runicast)) {
+		send_VALVE(&runicast, valve_report_slope, &mote);
+		valve_report_pending = 0;
+	}
+}
+
+void open_callback(void *ptr);
+
+/**
+ * Opens the valve : turns on the green LED, for OPEN_TIME seconds.
+ */
+void open_valve() {
+	leds_on(LEDS_GREEN);
+	valve_open = 1;
+	ctimer_set(&open_timer, CLOCK_SECOND*OPEN_TIME, open_callback, NULL);
+}
+
+/**
+ * Opens the valve if the slope of the window is over the threshold, and the valve is closed.
+ * The opening is reported to the server, so that it doesn't send an OPEN message.
+ */
+void local_decide() {
+	if (local_threshold == LOCAL_DISABLED || valve_open || local_count < LOCAL_WINDOW
+			|| local_times[(local_first + local_count - 1) % LOCAL_WINDOW] - local_times[local_first] >= 3600) {
+		// Not enough readings, or readings spread over more than an hour (mote detached)
+		return;
+	}
+	int16_t slope = local_slope();
+	if (slope > local_threshold) {
+		printf("Valve opened locally, slope %d\n", slope);
+		open_valve();
+		valve_report_pending = 1;
+		valve_report_slope = slope;
+	}
+}
+
+/**
+ * Adds a reading to the batch, dropping the oldest reading if the batch is full (the mote couldn't send it).
+ */
+void batch_add(uint16_t value, unsigned long time) {
+	if (batch_count == BATCH_SIZE) {
+		uint8_t i;
+		for (i = 1; i < BATCH_SIZE; i++) {
+			batch_values[i-1] = batch_values[i];
+			batch_times[i-1] = batch_times[i];
+		}
+		batch_count--;
+	}
+	batch_values[batch_count] = value;
+	batch_times[batch_count] = time;
+	batch_count++;
+}
+
 /**
  * Callback function that will send the appropriate message when ctimer has expired.
  */
@@ -104,6 +314,7 @@ void reset_timers() {
 /**
  * Resets the trickle timer, and stops all timers for events that happen when the mote is in the network.
  * This function is called when the mote detaches from the network.
+ * The readings go on, for the autonomous valve : only their sending is skipped while the mote is detached.
  */
 void stop_timers() {
 	trickle_reset(&t_timer);
@@ -112,22 +323,48 @@ void stop_timers() {
 	ctimer_stop(&DAO_timer);
 	ctimer_stop(&parent_timer);
 	ctimer_stop(&children_timer);
-	ctimer_stop(&data_timer);
 }
 
 /**
- * Callback function that will detach from the DODAG if the parent is lost.
+ * Callback function that will forget the subtree of the mote if it is still detached.
+ */
+void repair_callback(void *ptr) {
+	flush_routes(&mote);
+}
+
+void parent_callback(void *ptr);
+
+/**
+ * Repairs the route towards the root after the parent has been lost.
+ * Switches to an alternate parent if there is one, and re-announces the subtree in one DAO.
+ * Otherwise, poisons the subtree with one DIO and detaches, keeping the subtree for REPAIR_HOLD seconds.
+ */
+void repair() {
+	if (local_repair(&mote) == PARENT_CHANGED) {
+		send_DIO(&broadcast, &mote);
+		send_DAO_subtree(&runicast, &mote);
+		reset_timers();
+		ctimer_set(&parent_timer, CLOCK_SECOND*TIMEOUT_PARENT,
+			parent_callback, NULL);
+	} else {
+		// DIO with infinite rank, so that the children look for another parent at once
+		send_DIO(&broadcast, &mote);
+		stop_timers();
+		ctimer_set(&repair_timer, CLOCK_SECOND*REPAIR_HOLD,
+			repair_callback, NULL);
+	}
+}
+
+/**
+ * Callback function that will repair the route if the parent is lost.
  */
 void parent_callback(void *ptr) {
 	// Reset the timer
 	ctimer_reset(&parent_timer);
 
-	// Detach from DODAG only if node was already in DODAG
+	// Repair only if node was already in DODAG
 	if (mote.in_dodag) {
-		// Detach from DODAG
-		detach(&mote);
-		// Reset and stop timers
-		stop_timers();
+		repair();
 	}
 
 }
@@ -144,16 +381,55 @@ void children_callback(void *ptr) {
 		reset_timers();
 	}
 
+	// Forget neighbours that haven't sent a DIO since a long time
+	neighbour_delete_timeout(mote.neighbours);
+
+}
+
+/**
+ * Callback function that will report the statistics of the mote.
+ */
+void stats_callback(void *ptr) {
+	ctimer_reset(&stats_timer);
+	report_stats(&mote);
 }
 
 /**
- * Callback function that will send a data message to the parent.
+ * Callback function that will read the air quality, and send a data message to the parent if the reading
+ * must be reported.
+ * When the readings are batched, the reading is sent once BATCH_SIZE readings are waiting,
+ * or if the oldest one would wait more than BATCH_LATENCY seconds until the next reading.
  */
 void data_callback(void *ptr) {
-	// Send the data to parent if mote is in DODAG
-	if (mote.in_dodag) {
-		send_DATA(&runicast, &mote);
+	unsigned long time = clock_seconds();
+	uint16_t value = read_air_quality();
+	uint8_t report = must_report(value, time);
+
+	// Every reading is used by the autonomous valve, even if it isn't sent
+	local_add(value, time);
+	local_decide();
+
+	if (BATCH_SIZE == 1) {
+		// Send the data to parent if mote is in DODAG, the reading being reported again otherwise
+		if (report && mote.in_dodag && send_DATA(&runicast, value, &mote)) {
+			report_sent(value, time);
+		}
+	} else {
+		// A queued reading is sent with its batch : the newest reading of a full batch is never dropped
+		if (report) {
+			batch_add(value, time);
+			report_sent(value, time);
+		}
+		if (mote.in_dodag && batch_count > 0 && (batch_count == BATCH_SIZE
+				|| time + DATA_PERIOD + 5 - batch_times[0] > BATCH_LATENCY)) {
+			// Kept if runicast is busy, and sent with the next reading
+			if (send_DATA_BATCH(&runicast, batch_values, batch_times, batch_count, &mote)) {
+				batch_count = 0;
+			}
+		}
 	}
+	// Reported now if no data was sent, after the data otherwise
+	valve_report();
 
 	// Restart the timer with a new random value
 	ctimer_set(&data_timer, CLOCK_SECOND*(DATA_PERIOD-5) + (random_rand() % (CLOCK_SECOND*10)),
@@ -165,6 +441,7 @@ void data_callback(void *ptr) {
  */
 void open_callback(void *ptr) {
 	leds_off(LEDS_GREEN);
+	valve_open = 0;
 }
 
 
@@ -205,24 +482,75 @@ void runicast_recv(struct runicast_conn *conn, const linkaddr_t *from, uint8_t s
 			printf("Error adding to routing table\n");
 		}
 
+	} else if (type == DAO_AGG) {
+
+		// Aggregated DAO of a repaired subtree, add all its routes and forward to parent
+		DAO_AGG_message_t* message = (DAO_AGG_message_t*) packetbuf_dataptr();
+
+		int err = add_DAO_AGG_routes(mote.routing_table, message, from);
+		if (err == MAP_NEW || err == MAP_UPDATE) {
+
+			forward_DAO_AGG(conn, message, &mote);
+
+			if (err == MAP_NEW) { // New children were added to the routing table
+				reset_timers();
+			}
+
+		} else {
+			printf("Error adding to routing table\n");
+		}
+
 	} else if (type == DATA) {
 		// DATA packet, forward towards root
 		DATA_message_t* message = (DATA_message_t*) packetbuf_dataptr();
 		forward_DATA(conn, message, &mote);
 
+	} else if (type == DATA_BATCH) {
+		// DATA_BATCH packet, forward towards root
+		DATA_BATCH_message_t* message = (DATA_BATCH_message_t*) packetbuf_dataptr();
+		forward_DATA_BATCH(conn, message, &mote);
+
 	} else if (type == OPEN) {
 		// OPEN packet, forward towards destination
 		OPEN_message_t* message = (OPEN_message_t*) packetbuf_dataptr();
 		linkaddr_t dst_addr = message->dst_addr;
 		if (linkaddr_cmp(&dst_addr, &(mote.addr))) { // This is the concerned mote
-			// Open valve : turn on green LED
-			leds_on(LEDS_GREEN);
-			// Set timer to turn off green LED after 10 min
-			ctimer_set(&open_timer, CLOCK_SECOND*OPEN_TIME, open_callback, NULL);
-		} else { // This is not the concerned mote
-			forward_OPEN(conn, message, &mote);
+			// Open valve : turn on green LED, for 10 min
+			open_valve();
+		} else if (forward_OPEN(conn, message, &mote) == NO_ROUTE) {
+			// No route towards destination, ask for a fresh DAO and warn the origin
+			send_DAO_REQ(&broadcast, dst_addr);
+			send_ROUTE_MISS(conn, message->src_addr, dst_addr, OPEN, &mote);
 		}
 
+	} else if (type == CONFIG) {
+		// CONFIG packet, forward towards destination
+		CONFIG_message_t* message = (CONFIG_message_t*) packetbuf_dataptr();
+		linkaddr_t dst_addr = message->dst_addr;
+		if (linkaddr_cmp(&dst_addr, &(mote.addr))) { // This is the concerned mote
+			local_threshold = message->threshold;
+			printf("Threshold of the valve set to %d\n", local_threshold);
+		} else if (forward_CONFIG(conn, message, &mote) == NO_ROUTE) {
+			// No route towards destination, ask for a fresh DAO and warn the origin
+			send_DAO_REQ(&broadcast, dst_addr);
+			send_ROUTE_MISS(conn, message->src_addr, dst_addr, CONFIG, &mote);
+		}
+
+	} else if (type == VALVE) {
+		// VALVE packet, forward towards root
+		VALVE_message_t* message = (VALVE_message_t*) packetbuf_dataptr();
+		forward_VALVE(conn, message, &mote);
+
+	} else if (type == ROUTE_MISS) {
+		// ROUTE_MISS packet, forward towards origin of the OPEN message
+		ROUTE_MISS_message_t* message = (ROUTE_MISS_message_t*) packetbuf_dataptr();
+		forward_ROUTE_MISS(conn, message, &mote);
+
+	} else if (type == DAO_REQ) {
+		// DAO_REQ packet sent along the path towards the requested mote
+		DAO_REQ_message_t* message = (DAO_REQ_message_t*) packetbuf_dataptr();
+		route_DAO_REQ(conn, &broadcast, message, &mote);
+
 	} else {
 		printf("Unknown runicast message received.\n");
 	}
@@ -233,14 +561,16 @@ void runicast_recv(struct runicast_conn *conn, const linkaddr_t *from, uint8_t s
  * Callback function, called when an unicast packet is sent
  */
 void runicast_sent(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
-	// Nothing to do
+	// Runicast is free, report a pending opening of the valve
+	valve_report();
 }
 
 /**
  * Callback function, called when an unicast packet has timed out
  */
 void runicast_timeout(struct runicast_conn *c, const linkaddr_t *to, uint8_t retransmissions) {
-	// Nothing to do
+	// Runicast is free, report a pending opening of the valve
+	valve_report();
 }
 
 // Runicast callback functions
@@ -257,27 +587,33 @@ const struct runicast_callbacks runicast_callbacks = {runicast_recv, runicast_se
  */
 void broadcast_recv(struct broadcast_conn *conn, const linkaddr_t *from) {
 
-	// Strength of the last received packet
+	// Strength and link quality of the last received packet
 	signed char rss = cc2420_last_rssi;
+	uint8_t lqi = cc2420_last_correlation;
 
 	uint8_t* data = (uint8_t*) packetbuf_dataptr();
 	uint8_t type = *data;
 
 	if (type == DIS) { // DIS message received
 
-		// If the mote is already in a DODAG, send DIO packet
+		// If the mote is already in a DODAG, answer with a DIO after a random delay
 		if (mote.in_dodag) {
-			send_DIO(conn, &mote);
+			schedule_DIO_response(&DIO_response, conn, &mote);
 		}
 
 	} else if (type == DIO) { // DIO message received
 
 		DIO_message_t* message = (DIO_message_t*) packetbuf_dataptr();
-		if (linkaddr_cmp(from, &(mote.parent->addr))) { // DIO message received from parent
+		overheard_DIO(&DIO_response, message->rank);
+
+		// Smooth the link metrics of the sender, parent decisions use the smoothed rss and lqi
+		neighbour_t *neighbour = neighbour_update(mote.neighbours, from, message->rank, rss, lqi);
+		rss = neighbour_rss(neighbour);
+		lqi = neighbour_lqi(neighbour);
+		if (mote.in_dodag && linkaddr_cmp(from, &(mote.parent->addr))) { // DIO message received from parent
 
 			if (message->rank == INFINITE_RANK) { // Parent has detached from the DODAG
-				detach(&mote);
-				stop_timers();
+				repair();
 			} else { // Update info
 				// Restart timer to delete lost parent
 				ctimer_set(&parent_timer, CLOCK_SECOND*TIMEOUT_PARENT,
@@ -291,10 +627,12 @@ void broadcast_recv(struct broadcast_conn *conn, const linkaddr_t *from) {
 
 		} else {
 			// DIO message received from other mote
-			uint8_t code = choose_parent(&mote, from, message->rank, rss);
+			uint8_t code = choose_parent(&mote, from, message->rank, rss, lqi);
 		    if (code == PARENT_NEW) {
 				reset_timers();
-		    	send_DAO(&runicast, &mote);
+		    	// Announce the mote, and the subtree kept since it detached
+		    	send_DAO_subtree(&runicast, &mote);
+		    	ctimer_stop(&repair_timer);
 
 		    	// Start all timers that are used when mote is in DODAG
 		    	ctimer_set(&send_timer, trickle_random(&t_timer),
@@ -305,18 +643,21 @@ void broadcast_recv(struct broadcast_conn *conn, const linkaddr_t *from) {
 					parent_callback, NULL);
 				ctimer_set(&children_timer, CLOCK_SECOND*TIMEOUT_CHILDREN,
 					children_callback, NULL);
-				ctimer_set(&data_timer, CLOCK_SECOND*(DATA_PERIOD-5) + (random_rand() % (CLOCK_SECOND*10)),
-					data_callback, NULL);
 
 		    } else if (code == PARENT_CHANGED) {
 		    	// If parent has changed, send DIO message to update children
-		    	// and DAO to update routing tables, then reset timers
+		    	// and aggregated DAO to update routing tables, then reset timers
 		    	send_DIO(conn, &mote);
-		    	send_DAO(&runicast, &mote);
+		    	send_DAO_subtree(&runicast, &mote);
 		    	reset_timers();
 		    }
 		}
 
+	} else if (type == DAO_REQ) { // DAO_REQ message received
+
+		DAO_REQ_message_t* message = (DAO_REQ_message_t*) packetbuf_dataptr();
+		answer_DAO_REQ(&runicast, message, from, &mote);
+
 	} else { // Unknown message received
 		printf("Unknown broadcast message received.\n");
 	}
@@ -352,6 +693,13 @@ PROCESS_THREAD(sensor_mote, ev, data) {
 	broadcast_open(&broadcast, 129, &broadcast_call);
 	runicast_open(&runicast, 144, &runicast_callbacks);
 
+	// Start the statistics timer
+	ctimer_set(&stats_timer, CLOCK_SECOND*STATS_PERIOD, stats_callback, NULL);
+
+	// Start the readings, sent once the mote is in the DODAG, and used by the autonomous valve in any case
+	ctimer_set(&data_timer, CLOCK_SECOND*(DATA_PERIOD-5) + (random_rand() % (CLOCK_SECOND*10)),
+		data_callback, NULL);
+
 	while(1) {
 
 		// Start the sending timer
@@ -0,0 +1,183 @@
+/**
+ * Binary framing of the serial link between the root mote and the server.
+ */
+
+#include "serial-frame.h"
+
+
+///////////////////
+///  CONSTANTS  ///
+///////////////////
+
+// States of the reception of a frame
+#define RX_SYNC     0
+#define RX_LENGTH   1
+#define RX_TYPE     2
+#define RX_PAYLOAD  3
+#define RX_CRC_LOW  4
+#define RX_CRC_HIGH 5
+
+// Maximum size of a debug message
+#define DEBUG_MAX_LENGTH 80
+
+
+
+///////////////////
+///  VARIABLES  ///
+///////////////////
+
+// Process to poll when a frame has been received
+static struct process *rx_process = NULL;
+
+// 1 once the framing of the serial line is started, debug messages being then sent in frames
+static uint8_t framing = 0;
+
+// Frame being received, and state of the reception
+static frame_t rx_frame;
+static uint8_t rx_state = RX_SYNC;
+static uint8_t rx_index;
+static uint16_t rx_crc;
+
+// Queue of complete frames, waiting to be read by the process
+// The interrupt only moves ready_last and the process only moves ready_first
+static frame_t ready_frames[FRAME_RX_QUEUE];
+static volatile uint8_t ready_first = 0;
+static volatile uint8_t ready_last = 0;
+
+
+
+///////////////////
+///  FUNCTIONS  ///
+///////////////////
+
+/**
+ * Returns the CRC of a frame, computed on its length, type and payload.
+ */
+static uint16_t frame_crc(uint8_t type, const uint8_t *payload, uint8_t length) {
+	uint16_t crc = crc16_add(length, 0);
+	crc = crc16_add(type, crc);
+	return crc16_data(payload, length, crc);
+}
+
+/**
+ * Handles a byte received on the serial line (called from the UART interrupt).
+ * Frames with a wrong CRC are dropped, as well as frames received while the queue is full.
+ */
+static int frame_input_byte(unsigned char c) {
+	switch (rx_state) {
+	case RX_SYNC:
+		if (c == FRAME_SYNC) {
+			rx_state = RX_LENGTH;
+		}
+		break;
+	case RX_LENGTH:
+		rx_frame.length = c;
+		rx_state = (c <= FRAME_MAX_PAYLOAD) ? RX_TYPE : RX_SYNC;
+		break;
+	case RX_TYPE:
+		rx_frame.type = c;
+		rx_index = 0;
+		rx_state = (rx_frame.length > 0) ? RX_PAYLOAD : RX_CRC_LOW;
+		break;
+	case RX_PAYLOAD:
+		rx_frame.payload[rx_index++] = c;
+		if (rx_index == rx_frame.length) {
+			rx_state = RX_CRC_LOW;
+		}
+		break;
+	case RX_CRC_LOW:
+		rx_crc = c;
+		rx_state = RX_CRC_HIGH;
+		break;
+	case RX_CRC_HIGH:
+		rx_crc |= ((uint16_t) c) << 8;
+		rx_state = RX_SYNC;
+		if ((ready_last + 1) % FRAME_RX_QUEUE != ready_first
+			&& rx_crc == frame_crc(rx_frame.type, rx_frame.payload, rx_frame.length)) {
+			memcpy(&(ready_frames[ready_last]), &rx_frame, sizeof(frame_t));
+			ready_last = (ready_last + 1) % FRAME_RX_QUEUE;
+			process_poll(rx_process);
+		}
+		break;
+	}
+	return 0;
+}
+
+/**
+ * Starts reading frames from the serial line.
+ * The process is polled each time a complete and valid frame has been received.
+ */
+void frame_init(struct process *process) {
+	rx_process = process;
+	uart1_set_input(frame_input_byte);
+	framing = 1;
+}
+
+/**
+ * Copies the oldest received frame in frame.
+ * Returns 1 if a frame was waiting, 0 otherwise.
+ */
+uint8_t frame_read(frame_t *frame) {
+	if (ready_first == ready_last) {
+		return 0;
+	}
+	memcpy(frame, &(ready_frames[ready_first]), sizeof(frame_t));
+	ready_first = (ready_first + 1) % FRAME_RX_QUEUE;
+	return 1;
+}
+
+/**
+ * Sends a frame of the given type to the server.
+ */
+void frame_send(uint8_t type, const uint8_t *payload, uint8_t length) {
+	uint16_t crc = frame_crc(type, payload, length);
+	uint8_t i;
+
+	uart1_writeb(FRAME_SYNC);
+	uart1_writeb(length);
+	uart1_writeb(type);
+	for (i = 0; i < length; i++) {
+		uart1_writeb(payload[i]);
+	}
+	uart1_writeb(crc & 0xFF);
+	uart1_writeb(crc >> 8);
+}
+
+/**
+ * Sends a debug message to the server, formatted as printf does, in a FRAME_DEBUG frame.
+ * Before frame_init (sensor and computation motes), the message is printed as printf does.
+ */
+void frame_debug(const char *format, ...) {
+	char message[DEBUG_MAX_LENGTH];
+	va_list args;
+	va_start(args, format);
+	if (!framing) {
+		vprintf(format, args);
+		va_end(args);
+		return;
+	}
+	int length = vsnprintf(message, DEBUG_MAX_LENGTH, format, args);
+	va_end(args);
+
+	if (length >= DEBUG_MAX_LENGTH) {
+		length = DEBUG_MAX_LENGTH - 1; // message has been truncated
+	}
+	if (length > 0) {
+		frame_send(FRAME_DEBUG, (uint8_t*) message, length);
+	}
+}
+
+/**
+ * Writes a 16 bits value, little-endian, at the given position of a payload.
+ */
+void frame_put_u16(uint8_t *payload, uint16_t value) {
+	payload[0] = value & 0xFF;
+	payload[1] = value >> 8;
+}
+
+/**
+ * Reads a 16 bits value, little-endian, at the given position of a payload.
+ */
+uint16_t frame_get_u16(const uint8_t *payload) {
+	return payload[0] | (((uint16_t) payload[1]) << 8);
+}
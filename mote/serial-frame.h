@@ -0,0 +1,107 @@
+/**
+ * Binary framing of the serial link between the root mote and the server.
+ *
+ * A frame is made of : SYNC (1 byte) | LENGTH of the payload (1 byte) | TYPE (1 byte) | PAYLOAD | CRC (2 bytes).
+ * The CRC is the CRC-16 of Contiki (lib/crc16) of LENGTH, TYPE and PAYLOAD.
+ * All the multi-byte fields are little-endian, and a payload carries several records of the same type.
+ * The debug text of the root mote (and of the shared code it runs) is sent in FRAME_DEBUG frames by frame_debug,
+ * nothing is printed raw on the serial line once the framing is started.
+ */
+
+#include "contiki.h"
+#include "net/rime/rime.h"
+#include "dev/uart1.h"
+#include "lib/crc16.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+
+///////////////////
+///  CONSTANTS  ///
+///////////////////
+
+// First byte of a frame
+#define FRAME_SYNC 0x7E
+
+// Maximum size of the payload of a frame
+#define FRAME_MAX_PAYLOAD 120
+
+// Types of frames
+#define FRAME_DATA   0 // root -> server, DATA records
+#define FRAME_OPEN   1 // server -> root, OPEN records
+#define FRAME_DEBUG  2 // root -> server, debug text
+#define FRAME_STATS  3 // root -> server, statistics of the ingress buffer
+#define FRAME_ACK    4 // root -> server, outcome of OPEN and CONFIG commands
+#define FRAME_VALVE  5 // root -> server, valves opened by the sensor motes themselves
+#define FRAME_CONFIG 6 // server -> root, CONFIG records
+
+// Size of the records
+#define DATA_RECORD_SIZE 6 // source address (2 bytes), data (2 bytes), age of the reading [sec] (2 bytes)
+#define OPEN_RECORD_SIZE 4 // command id (2 bytes), destination address (2 bytes)
+#define STATS_RECORD_SIZE 4 // dropped readings (2 bytes), maximum buffered readings (2 bytes)
+#define ACK_RECORD_SIZE 5 // command id (2 bytes), destination address (2 bytes), status (1 byte)
+#define VALVE_RECORD_SIZE 4 // source address (2 bytes), slope [centi-A.Q.I. per minute] (2 bytes, signed)
+#define CONFIG_RECORD_SIZE 6 // command id (2 bytes), destination address (2 bytes), threshold (2 bytes, signed)
+
+// Status of an OPEN (or CONFIG) command, in ACK records
+#define ACK_DELIVERED  0 // OPEN message acknowledged by the next hop
+#define ACK_FAILED     1 // OPEN message not acknowledged by the next hop
+#define ACK_NO_ROUTE   2 // no route towards the destination, even after MAX_OPEN_RETRIES retries
+#define ACK_QUEUE_FULL 3 // command queue of the root was full
+
+// Number of slots of the queue of received frames (one slot is always free)
+#define FRAME_RX_QUEUE 4
+
+
+
+////////////////////
+///  DATA TYPES  ///
+////////////////////
+
+// Represents a frame received from the server
+typedef struct frame {
+	uint8_t type;
+	uint8_t length;
+	uint8_t payload[FRAME_MAX_PAYLOAD];
+} frame_t;
+
+
+
+///////////////////
+///  FUNCTIONS  ///
+///////////////////
+
+/**
+ * Starts reading frames from the serial line.
+ * The process is polled each time a complete and valid frame has been received.
+ */
+void frame_init(struct process *process);
+
+/**
+ * Copies the oldest received frame in frame.
+ * Returns 1 if a frame was waiting, 0 otherwise.
+ */
+uint8_t frame_read(frame_t *frame);
+
+/**
+ * Sends a frame of the given type to the server.
+ */
+void frame_send(uint8_t type, const uint8_t *payload, uint8_t length);
+
+/**
+ * Sends a debug message to the server, formatted as printf does, in a FRAME_DEBUG frame.
+ * Before frame_init (sensor and computation motes), the message is printed as printf does.
+ */
+void frame_debug(const char *format, ...);
+
+/**
+ * Writes a 16 bits value, little-endian, at the given position of a payload.
+ */
+void frame_put_u16(uint8_t *payload, uint16_t value);
+
+/**
+ * Reads a 16 bits value, little-endian, at the given position of a payload.
+ */
+uint16_t frame_get_u16(const uint8_t *payload);
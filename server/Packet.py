@@ -1,68 +1,372 @@
+from array import array
+import binascii
+import struct
+import sys
 import time
 
 DATA_PACKET = 0
 OPEN_PACKET = 1
+DEBUG_FRAME = 2
+STATS_FRAME = 3
+ACK_FRAME = 4
+VALVE_FRAME = 5
+CONFIG_FRAME = 6
+
+# Status of an OPEN command, acknowledged by the root mote
+ACK_DELIVERED = 0
+ACK_FAILED = 1
+ACK_NO_ROUTE = 2
+ACK_QUEUE_FULL = 3
+
+# Threshold of a CONFIG command that disables the autonomous valve of a sensor mote
+LOCAL_DISABLED = 0x7FFF
+
+# Binary framing of the serial link with the root mote (see mote/serial-frame.h) :
+# SYNC | LENGTH of the payload | TYPE | PAYLOAD | CRC-16 of LENGTH, TYPE and PAYLOAD (little-endian)
+FRAME_SYNC = 0x7E
+FRAME_MAX_PAYLOAD = 120
+FRAME_HEADER = struct.Struct("<BBB")
+FRAME_CRC = struct.Struct("<H")
+FRAME_OVERHEAD = FRAME_HEADER.size + FRAME_CRC.size
+
+# Records carried by the payload of the frames
+DATA_RECORD = struct.Struct("<HHH") # source address, data, age of the reading [sec] when the root sent it
+OPEN_RECORD = struct.Struct("<HH")  # command id, destination address
+STATS_RECORD = struct.Struct("<HH") # readings dropped by the root, maximum readings buffered by the root
+ACK_RECORD = struct.Struct("<HHB")  # command id, destination address, status
+VALVE_RECORD = struct.Struct("<Hh")  # source address, slope [centi-AQI per minute] that opened the valve
+CONFIG_RECORD = struct.Struct("<HHh") # command id, destination address, threshold [centi-AQI per minute]
+
+# Layouts of the payloads of n records, precompiled for every number of records a frame can carry
+OPEN_PAYLOADS = [struct.Struct("<" + "HH" * n) for n in range(FRAME_MAX_PAYLOAD // OPEN_RECORD.size + 1)]
+
+# The records are little-endian, arrays of the host byte order must be swapped on big-endian hosts
+BIG_ENDIAN = sys.byteorder == "big"
+
+
+# Bit-reversal of every byte value, to compute the reflected CRC of Contiki with binascii
+BIT_REVERSE = bytes(int("{:08b}".format(i)[::-1], 2) for i in range(256))
+
+
+def crc16(data):
+    """
+    Computes the CRC-16 used by Contiki (lib/crc16.c), with an initial value of 0.
+    This reflected CRC is the bit-reversed CCITT CRC (binascii.crc_hqx) of the bit-reversed bytes.
+    :param data: bytes or bytearray to compute the CRC of
+    :return: the CRC
+    """
+    crc = binascii.crc_hqx(data.translate(BIT_REVERSE), 0)
+    return (BIT_REVERSE[crc & 0xFF] << 8) | BIT_REVERSE[crc >> 8]
+
+
+def encode_frame(frame_type, payload):
+    """
+    Encodes a frame
+    :param frame_type: type of the frame
+    :param payload: records carried by the frame
+    :return: the encoded frame
+    """
+    header = bytes((len(payload), frame_type)) + payload
+    return bytes((FRAME_SYNC,)) + header + FRAME_CRC.pack(crc16(header))
+
+
+def encode_packets(packets):
+    """
+    Encodes packets of the same type, with as many records per frame as possible
+    :param packets: the packets to encode
+    :return: the encoded frames
+    """
+    if not packets:
+        return b""
+    record_size = len(packets[0].record())
+    per_frame = FRAME_MAX_PAYLOAD // record_size
+    return b"".join(encode_frame(packets[0].type, b"".join(packet.record() for packet in packets[i:i + per_frame]))
+                    for i in range(0, len(packets), per_frame))
+
+
+def encode_opens(command_ids, addresses):
+    """
+    Encodes OPEN commands without creating packets, with as many records per frame as possible
+    :param command_ids: ids of the commands
+    :param addresses: destination addresses of the commands, in the same order
+    :return: the encoded frames
+    """
+    per_frame = len(OPEN_PAYLOADS) - 1
+    fields = [field for record in zip(command_ids, addresses) for field in record]
+    frames = []
+    for i in range(0, len(fields), 2 * per_frame):
+        chunk = fields[i:i + 2 * per_frame]
+        frames.append(encode_frame(OPEN_PACKET, OPEN_PAYLOADS[len(chunk) // 2].pack(*chunk)))
+    return b"".join(frames)
+
+
+def parse_data(frames):
+    """
+    Fast path of the parsing of the received frames : the records of all the DATA frames are parsed in one pass
+    into parallel arrays, without creating a packet per reading (nor reading the clock per reading)
+    :param frames: list of the (type, payload) of decoded frames
+    :return: arrays of the source addresses, of the data and of the ages of the DATA records, in the order of
+             reception, and list of the (type, payload) of the other frames
+    """
+    payloads, others = [], []
+    for frame in frames:
+        if frame[0] == DATA_PACKET:
+            payload = frame[1]
+            payloads.append(payload[:len(payload) - len(payload) % DATA_RECORD.size])
+        else:
+            others.append(frame)
+    records = array("H", b"".join(payloads))
+    if BIG_ENDIAN:
+        records.byteswap()
+    return records[0::3], records[1::3], records[2::3], others
 
-HEX_SIZE_OF_TYPE = 2
-HEX_SIZE_OF_ADDR = 4
-HEX_SIZE_OF_DATA = 2
 
 class Packet:
-    def __init__(self, address):
+    def __init__(self, address, t=None):
+        """
+        :param address: address of the mote
+        :param t: reception time of the packet, None for the current time (a simulated time when replaying a trace)
+        """
         self.address = address
         self.type = -1
-        self.time = round(time.time())
+        self.time = round(time.time()) if t is None else t
+
+    def record(self):
+        """
+        Encodes the record of the packet, carried in the payload of a frame
+        :return: the encoded record
+        """
+        return b""
 
     def encode(self):
         """
         Encodes the packet
-        :return: the encoded packet using format TYPE/ADDRESS
+        :return: the encoded packet, in a frame of its own
         """
-        if self.type < 0:
-            return "0"
-        return "{}/{}".format(self.type, self.address)
+        return encode_frame(self.type, self.record())
 
 
 class DataPacket(Packet):
-    def __init__(self, src_addr, data):
-        super().__init__(src_addr)
+    def __init__(self, src_addr, data, t=None, age=0):
+        """
+        :param age: age [sec] of the reading when the root sent it (batched by the sensor, or buffered by the root) :
+                    the time of the packet is the time the reading was read
+        """
+        super().__init__(src_addr, t)
         self.data = data
+        self.age = age
+        self.time -= age
         self.type = DATA_PACKET
 
-    def encode(self):
+    def record(self):
         """
-        Encodes the packet
-        :return: the encoded packet using format TYPE/ADDRESS/DATA
+        Encodes the record of the packet
+        :return: the encoded record using format ADDRESS/DATA/AGE
         """
-        return "{}/{}".format(super().encode(), self.data)
+        return DATA_RECORD.pack(self.address, self.data, self.age)
 
 
 class OpenPacket(Packet):
-    def __init__(self, dst_addr):
+    def __init__(self, dst_addr, command_id=0):
         super().__init__(dst_addr)
+        self.command_id = command_id
         self.type = OPEN_PACKET
 
+    def record(self):
+        """
+        Encodes the record of the packet
+        :return: the encoded record using format ID/ADDRESS
+        """
+        return OPEN_RECORD.pack(self.command_id, self.address)
+
+
+class ConfigPacket(Packet):
+    def __init__(self, dst_addr, threshold, command_id=0):
+        """
+        :param threshold: slope [centi-AQI per minute] over which the sensor mote opens its valve itself,
+                          LOCAL_DISABLED to leave the valve to the OPEN commands
+        """
+        super().__init__(dst_addr)
+        self.threshold = threshold
+        self.command_id = command_id
+        self.type = CONFIG_FRAME
+
+    def record(self):
+        """
+        Encodes the record of the packet
+        :return: the encoded record using format ID/ADDRESS/THRESHOLD
+        """
+        return CONFIG_RECORD.pack(self.command_id, self.address, self.threshold)
+
+
+class ValvePacket(Packet):
+    def __init__(self, src_addr, slope):
+        """
+        :param slope: slope [centi-AQI per minute] for which the sensor mote opened its valve itself
+        """
+        super().__init__(src_addr)
+        self.slope = slope
+        self.type = VALVE_FRAME
+
+    def record(self):
+        """
+        Encodes the record of the packet
+        :return: the encoded record using format ADDRESS/SLOPE
+        """
+        return VALVE_RECORD.pack(self.address, self.slope)
+
+
+class AckPacket(Packet):
+    def __init__(self, dst_addr, command_id, status):
+        super().__init__(dst_addr)
+        self.command_id = command_id
+        self.status = status
+        self.type = ACK_FRAME
+
+    def record(self):
+        """
+        Encodes the record of the packet
+        :return: the encoded record using format ID/ADDRESS/STATUS
+        """
+        return ACK_RECORD.pack(self.command_id, self.address, self.status)
+
+
+class FrameDecoder:
+    """
+    Splits the byte stream received from the root mote into frames.
+    Bytes outside of frames are debug output of the mote, split into lines.
+    The bytes are received in chunks directly in a preallocated buffer, and frames are
+    returned as views on this buffer : they are only valid until the next chunk is received.
+    """
+
+    def __init__(self, size=1 << 16):
+        self.buffer = bytearray(size)
+        self.start = 0  # first byte not decoded yet
+        self.end = 0    # end of the received bytes
+        self.debug = bytearray()
+        self.errors = 0  # frames with a bad length or CRC
+
+    def _make_room(self):
+        """
+        Moves the bytes not decoded yet to the beginning of the buffer, and grows it if it is full
+        """
+        if self.start > 0:
+            remaining = self.end - self.start
+            self.buffer[:remaining] = self.buffer[self.start:self.end]
+            self.start, self.end = 0, remaining
+        if self.end == len(self.buffer):
+            self.buffer.extend(bytes(len(self.buffer)))
+
+    def get_buffer(self):
+        """
+        Gives the free part of the buffer, where the next bytes must be received
+        :return: a memoryview on the free part of the buffer, to release before the next call
+        """
+        self._make_room()
+        return memoryview(self.buffer)[self.end:]
+
+    def buffer_updated(self, received):
+        """
+        Adds the bytes received in the free part of the buffer
+        :param received: number of bytes received
+        :return: None
+        """
+        self.end += received
+
+    def recv_from(self, sock):
+        """
+        Receives the available bytes of a socket in the buffer
+        :param sock: the socket to read from (non-blocking or readable)
+        :return: the number of received bytes (0 if the connection was closed)
+        """
+        with self.get_buffer() as view:
+            received = sock.recv_into(view)
+        self.buffer_updated(received)
+        return received
+
+    def feed(self, data):
+        """
+        Adds received bytes to the buffer
+        :param data: the received bytes
+        :return: None
+        """
+        self._make_room()
+        while self.end + len(data) > len(self.buffer):
+            self.buffer.extend(bytes(len(self.buffer)))
+        self.buffer[self.end:self.end + len(data)] = data
+        self.end += len(data)
+
+    def decode(self):
+        """
+        Decodes the received bytes
+        :return: list of the (type, payload) of the complete frames, the payloads being memoryviews valid
+                 until the next reception, and list of the complete debug lines
+        """
+        frames = []
+        buf = self.buffer
+        view = memoryview(buf)
+        pos, end = self.start, self.end
+        while True:
+            sync = buf.find(FRAME_SYNC, pos, end)
+            if sync < 0:
+                self.debug += view[pos:end]
+                pos = end
+                break
+            self.debug += view[pos:sync]
+            pos = sync
+            if end - pos < FRAME_HEADER.size:
+                break
+            _, length, frame_type = FRAME_HEADER.unpack_from(buf, pos)
+            frame_end = pos + FRAME_HEADER.size + length + FRAME_CRC.size
+            if length > FRAME_MAX_PAYLOAD:
+                # Not a frame, the sync byte was part of the debug output
+                self.debug.append(FRAME_SYNC)
+                self.errors += 1
+                pos += 1
+                continue
+            if end < frame_end:
+                break
+            crc, = FRAME_CRC.unpack_from(buf, frame_end - FRAME_CRC.size)
+            if crc != crc16(buf[pos + 1:frame_end - FRAME_CRC.size]):
+                self.debug.append(FRAME_SYNC)
+                self.errors += 1
+                pos += 1
+                continue
+            frames.append((frame_type, view[pos + FRAME_HEADER.size:frame_end - FRAME_CRC.size]))
+            pos = frame_end
+        self.start = pos
+
+        lines = []
+        newline = self.debug.rfind(b"\n")
+        if newline >= 0:
+            lines = self.debug[:newline].decode("utf-8", "replace").split("\n")
+            del self.debug[:newline + 1]
+        return frames, lines
+
 
 class PackFactory:
     @staticmethod
-    def parse_packet(raw_packet):
-        """
-        Parses the raw_packet to return a Packet or None if the raw_packet does not correspond to a packet
-        :param raw_packet: the packet received over the socket connection
-        :return: Packet|None
-        """
-        packet = raw_packet.decode("utf-8").split('/')
-        try:
-            packet_type = int(packet[0])
-
-            if packet_type == DATA_PACKET:
-                src_addr = int(packet[1])
-                data = int(packet[2])
-                return DataPacket(src_addr, data)
-            elif packet_type == OPEN_PACKET:
-                dst_addr = packet[1]
-                return OpenPacket(dst_addr)
-            else:
-                return None
-        except Exception:
-            return None
\ No newline at end of file
+    def parse_frame(frame_type, payload):
+        """
+        Parses the payload of a frame to return the Packets it carries
+        :param frame_type: type of the frame received over the socket connection
+        :param payload: payload of the frame
+        :return: list of Packet, empty if the frame does not carry packets
+        """
+        if frame_type == DATA_PACKET:
+            return [DataPacket(src_addr, data, age=age) for src_addr, data, age in DATA_RECORD.iter_unpack(
+                payload[:len(payload) - len(payload) % DATA_RECORD.size])]
+        elif frame_type == OPEN_PACKET:
+            return [OpenPacket(dst_addr, command_id) for command_id, dst_addr in OPEN_RECORD.iter_unpack(
+                payload[:len(payload) - len(payload) % OPEN_RECORD.size])]
+        elif frame_type == ACK_FRAME:
+            return [AckPacket(dst_addr, command_id, status) for command_id, dst_addr, status in ACK_RECORD.iter_unpack(
+                payload[:len(payload) - len(payload) % ACK_RECORD.size])]
+        elif frame_type == VALVE_FRAME:
+            return [ValvePacket(src_addr, slope) for src_addr, slope in VALVE_RECORD.iter_unpack(
+                payload[:len(payload) - len(payload) % VALVE_RECORD.size])]
+        elif frame_type == CONFIG_FRAME:
+            return [ConfigPacket(dst_addr, threshold, command_id) for command_id, dst_addr, threshold in
+                    CONFIG_RECORD.iter_unpack(payload[:len(payload) - len(payload) % CONFIG_RECORD.size])]
+        else:
+            return []
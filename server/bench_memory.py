@@ -0,0 +1,65 @@
+"""
+Benchmark of the memory used by the state of the server.
+Fills the state of a number of simulated motes, each with a full window of values :
+- as the server used to store it, in a dict of lists of (time, data) tuples and a dict of reception times;
+- in the columnar store of the server.
+
+Usage : python3 bench_memory.py [numbers of motes]
+"""
+
+from server import DUPLICATE_DELAY, WINDOW_SIZE, mote_key
+from store import MoteStore
+import random
+import sys
+import time
+import tracemalloc
+
+
+def samples(now):
+    """
+    :param now: time of the first sample
+    :return: a full window of new (time, data) samples, as parsed from the frames of the root mote
+    """
+    return [(now + DUPLICATE_DELAY * i, random.randrange(1000, 60000)) for i in range(WINDOW_SIZE)]
+
+
+def fill_dicts(keys, now):
+    values, last_received = {}, {}
+    for key in keys:
+        values[key] = samples(now)
+        last_received[key] = values[key][-1][0]
+    return values, last_received
+
+
+def fill_store(keys, now):
+    store = MoteStore(WINDOW_SIZE)
+    for key in keys:
+        slot = store.slot(key)
+        for t, data in samples(now):
+            store.add(slot, t, data)
+        store.last_received[slot] = t
+    return store
+
+
+def measure(fill, keys, now):
+    """
+    :return: the memory [bytes] allocated by fill for the state of the motes
+    """
+    tracemalloc.start()
+    state = fill(keys, now)
+    size, _ = tracemalloc.get_traced_memory()
+    tracemalloc.stop()
+    del state
+    return size
+
+
+if __name__ == '__main__':
+    sizes = [int(n) for n in sys.argv[1:]] or [10000, 100000]
+    now = round(time.time())
+    for nb_motes in sizes:
+        # Networks of 1000 motes
+        keys = [mote_key(root, address) for root in range(nb_motes // 1000 + 1) for address in range(1, 1001)][:nb_motes]
+        print("{} motes, {} values per mote".format(nb_motes, WINDOW_SIZE))
+        for name, fill in (("dicts", fill_dicts), ("store", fill_store)):
+            size = measure(fill, keys, now)
+            print("  {:<6} {:>8.1f} MB {:>8.0f} bytes/mote".format(name, size / 1e6, size / nb_motes))
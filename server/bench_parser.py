@@ -0,0 +1,98 @@
+"""
+Benchmark of the parsers of the readings, on chunks already received (no socket) :
+- text lines ADDRESS/DATA, parsed as the server used to do (decode, split, int, exceptions for the debug lines);
+- binary frames, parsed into a DataPacket per reading (PackFactory.parse_frame);
+- binary frames, parsed into parallel arrays of addresses, data and ages (parse_data, fast path of the server).
+
+Usage : python3 bench_parser.py [number of readings]
+"""
+
+from Packet import *
+import random
+import sys
+import time
+
+# Bytes received at once from the socket
+CHUNK_SIZE = 1 << 16
+
+
+def parse_text(chunks):
+    """
+    Parses text lines as the server used to do
+    :return: the number of parsed readings
+    """
+    readings = 0
+    rest = b""
+    for chunk in chunks:
+        lines = (rest + chunk).split(b"\n")
+        rest = lines.pop()
+        for line in lines:
+            fields = line.decode("utf-8").split("/")
+            try:
+                if int(fields[0]) == DATA_PACKET:
+                    DataPacket(int(fields[1]), int(fields[2]))
+                    readings += 1
+            except (ValueError, IndexError):
+                pass
+    return readings
+
+
+def parse_packets(chunks):
+    """
+    Decodes the frames and parses them into packets
+    :return: the number of parsed readings
+    """
+    decoder = FrameDecoder()
+    readings = 0
+    for chunk in chunks:
+        decoder.feed(chunk)
+        frames, _ = decoder.decode()
+        for frame_type, payload in frames:
+            readings += len(PackFactory.parse_frame(frame_type, payload))
+            payload.release()
+        del frames
+    return readings
+
+
+def parse_arrays(chunks):
+    """
+    Decodes the frames and parses them into arrays, as the server does
+    :return: the number of parsed readings
+    """
+    decoder = FrameDecoder()
+    readings = 0
+    for chunk in chunks:
+        decoder.feed(chunk)
+        frames, _ = decoder.decode()
+        addresses, values, ages, others = parse_data(frames)
+        readings += len(addresses)
+        del frames, others
+    return readings
+
+
+def bench(name, parser, stream, readings):
+    chunks = [stream[i:i + CHUNK_SIZE] for i in range(0, len(stream), CHUNK_SIZE)]
+    start = time.perf_counter()
+    parsed = parser(chunks)
+    elapsed = time.perf_counter() - start
+    assert parsed == readings, "{} : {} readings parsed instead of {}".format(name, parsed, readings)
+    print("{:<8} {:>9} bytes {:>8.3f} s {:>12.0f} readings/s".format(name, len(stream), elapsed, readings / elapsed))
+
+
+if __name__ == '__main__':
+    nb_readings = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+    packets = [DataPacket(random.randrange(1, 1000), random.randrange(501)) for _ in range(nb_readings)]
+
+    # Readings forwarded by batches of 30, with a debug line of the root mote about every 100 readings
+    text, frames = [], []
+    for i in range(0, nb_readings, 30):
+        batch = packets[i:i + 30]
+        text += ["{}/{}/{}\n".format(DATA_PACKET, packet.address, packet.data).encode() for packet in batch]
+        frames.append(encode_packets(batch))
+        if i % 100 < 30:
+            text.append(b"Mote not in routing table.\n")
+            frames.append(b"Mote not in routing table.\n")
+
+    bench("text", parse_text, b"".join(text), nb_readings)
+    bench("packets", parse_packets, b"".join(frames), nb_readings)
+    bench("arrays", parse_arrays, b"".join(frames), nb_readings)
@@ -0,0 +1,108 @@
+"""
+Benchmark of the socket reader of the server.
+A local socket stands in for the serial socket of Cooja, and sends the same readings :
+- as text lines, read byte by byte as the server used to do (one recv and one decode per byte);
+- as binary frames, read in chunks by the buffered decoder of the server.
+
+Usage : python3 bench_reader.py [number of readings]
+"""
+
+from Packet import *
+import random
+import select
+import socket
+import sys
+import threading
+import time
+
+
+def serve(stream):
+    """
+    Opens a local socket that sends stream to the first client, then closes the connection
+    :param stream: the bytes to send
+    :return: the port of the socket
+    """
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.bind(("127.0.0.1", 0))
+    listener.listen(1)
+
+    def run():
+        connection, _ = listener.accept()
+        connection.sendall(stream)
+        connection.close()
+        listener.close()
+
+    threading.Thread(target=run, daemon=True).start()
+    return listener.getsockname()[1]
+
+
+def read_bytewise(port):
+    """
+    Reads text lines one byte at a time, as the server used to do
+    :return: the number of parsed readings
+    """
+    sock = socket.create_connection(("127.0.0.1", port))
+    readings = 0
+    while True:
+        data = sock.recv(1)
+        buf = b""
+        while data and data.decode("utf-8") != "\n":
+            buf += data
+            data = sock.recv(1)
+        if not data:
+            return readings
+        fields = buf.decode("utf-8").split("/")
+        try:
+            if int(fields[0]) == DATA_PACKET:
+                DataPacket(int(fields[1]), int(fields[2]))
+                readings += 1
+        except Exception:
+            pass
+
+
+def read_buffered(port):
+    """
+    Reads binary frames in chunks from a non-blocking socket, as the server does
+    :return: the number of parsed readings
+    """
+    sock = socket.create_connection(("127.0.0.1", port))
+    sock.setblocking(False)
+    decoder = FrameDecoder()
+    readings = 0
+    while True:
+        select.select([sock], [], [])
+        try:
+            if decoder.recv_from(sock) == 0:
+                return readings
+        except BlockingIOError:
+            continue
+        frames, _ = decoder.decode()
+        for frame_type, payload in frames:
+            readings += len(PackFactory.parse_frame(frame_type, payload))
+        del frames
+
+
+def bench(name, reader, stream, readings):
+    start = time.perf_counter()
+    parsed = reader(serve(stream))
+    elapsed = time.perf_counter() - start
+    assert parsed == readings, "{} : {} readings parsed instead of {}".format(name, parsed, readings)
+    print("{:<10} {:>9} bytes {:>8.3f} s {:>12.0f} readings/s".format(name, len(stream), elapsed, readings / elapsed))
+
+
+if __name__ == '__main__':
+    nb_readings = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+    packets = [DataPacket(random.randrange(1, 1000), random.randrange(501)) for _ in range(nb_readings)]
+
+    # Readings forwarded by batches of 30, with a debug line of the root mote about every 100 readings
+    text, frames = [], []
+    for i in range(0, nb_readings, 30):
+        batch = packets[i:i + 30]
+        text += ["{}/{}/{}\n".format(DATA_PACKET, packet.address, packet.data).encode() for packet in batch]
+        frames.append(encode_packets(batch))
+        if i % 100 < 30:
+            text.append(b"Mote not in routing table.\n")
+            frames.append(b"Mote not in routing table.\n")
+
+    bench("bytewise", read_bytewise, b"".join(text), nb_readings)
+    bench("buffered", read_buffered, b"".join(frames), nb_readings)
@@ -0,0 +1,85 @@
+"""
+Benchmark of the repair of the routes, from the mote output of Cooja simulations (Mote output window,
+"Save to file"), to compare a build with local repair (LOCAL_REPAIR 1, the default) and a build without it
+(make DEFINES=LOCAL_REPAIR=0), on the same simulation with the same motes removed :
+- reconvergence : time [sec] from the detach of a mote to its re-attachment (REPAIR lines);
+- repairs without detach, the mote switching to an alternate parent at once;
+- control frames (DIS, DIO, DAO, DAO_REQ), DAO frames (DAO and DAO_AGG, sent or forwarded : the DAO storm
+  after a repair) and parent changes, reported every STATS_PERIOD (STATS lines) : the simulations must last
+  longer than STATS_PERIOD;
+- route misses : OPEN and CONFIG messages without route on a mote of their path (stale routes).
+
+Usage : python3 bench_repair.py [mote output] [mote output ...]
+"""
+
+import re
+import sys
+
+REATTACHED = re.compile(r"REPAIR mote (\d+\.\d+) : re-attached after (\d+) sec")
+SWITCHED = re.compile(r"REPAIR mote (\d+\.\d+) : switching to alternate parent")
+STATS = re.compile(r"STATS mote (\d+\.\d+) : (\d+) parent changes, (\d+) control frames(?:, (\d+) DAO)?")
+ROUTE_MISS = re.compile(r"not in routing table|: no route")
+
+
+def percentile(values, p):
+    """
+    :param values: sorted values
+    :param p: percentile, in [0, 100]
+    :return: the percentile of the values, None if there are none
+    """
+    if not values:
+        return None
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def analyse(path):
+    """
+    :param path: path of the mote output of a simulation
+    :return: dict of the statistics of the simulation
+    """
+    reconvergence = []
+    switched = parent_changes = control_frames = dao_frames = route_misses = 0
+    motes = set()
+    with open(path, errors="replace") as output:
+        for line in output:
+            match = REATTACHED.search(line)
+            if match:
+                reconvergence.append(int(match.group(2)))
+                continue
+            if SWITCHED.search(line):
+                switched += 1
+                continue
+            match = STATS.search(line)
+            if match:
+                motes.add(match.group(1))
+                parent_changes += int(match.group(2))
+                control_frames += int(match.group(3))
+                dao_frames += int(match.group(4) or 0)
+                continue
+            if ROUTE_MISS.search(line):
+                route_misses += 1
+    reconvergence.sort()
+    return {"reconvergence": reconvergence, "switched": switched, "parent_changes": parent_changes,
+            "control_frames": control_frames, "dao_frames": dao_frames, "route_misses": route_misses,
+            "motes": len(motes)}
+
+
+def report(path, stats):
+    reconvergence = stats["reconvergence"]
+    print(path)
+    print("  {} re-attachments after a detach, {} switches to an alternate parent".format(
+        len(reconvergence), stats["switched"]))
+    if reconvergence:
+        print("  reconvergence [sec]: p50 {}, p90 {}, max {}".format(
+            percentile(reconvergence, 50), percentile(reconvergence, 90), reconvergence[-1]))
+    print("  {} control frames ({} DAO) and {} parent changes reported by {} motes, {} route misses".format(
+        stats["control_frames"], stats["dao_frames"], stats["parent_changes"], stats["motes"],
+        stats["route_misses"]))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) < 2:
+        print(__doc__.strip())
+        sys.exit(1)
+    for path in sys.argv[1:]:
+        report(path, analyse(path))
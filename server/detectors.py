@@ -0,0 +1,353 @@
+"""
+Anomaly detectors of the server, evaluated on a pool of worker threads over the columnar store of the decision
+engine, instead of on every reading :
+- slope : slope of the least square regression of the window of a mote, over the threshold (as the engine);
+- ewma : fast exponentially weighted moving average of the values, over a slow one by EWMA_MARGIN;
+- cusum : cumulative sum of the deviations of the values over a slow average (upward CUSUM), over CUSUM_LIMIT;
+- kalman : trend of a local linear trend Kalman filter (level and slope), over the threshold by KALMAN_CONFIDENCE
+  standard deviations of its estimate.
+The slope and Kalman detectors compare a slope [AQI per sec] to the threshold of the server. The EWMA and CUSUM
+detectors don't estimate a slope : they have their own limits in AQI, EWMA_MARGIN and CUSUM_LIMIT.
+The engine marks the motes that sent readings for every detector. Each detector runs every DETECTOR_PERIOD in its
+own worker thread, on the motes marked since its last run, within a CPU budget per run : the motes it could not
+evaluate are left for its next run, so that a costly detector lags instead of slowing the ingestion.
+A detector reads the windows of the store while the server adds readings to them : the values and the sums of
+a mote are read under the lock of the store, so that a reading is seen with all its changes or not at all.
+A mote may be evaluated without its last reading, which is then evaluated on the next run.
+"""
+
+from array import array
+from concurrent.futures import ThreadPoolExecutor
+from metrics import REGISTRY
+import asyncio
+import math
+import time
+
+# Period [sec] of the runs of the detectors
+DETECTOR_PERIOD = 1
+
+# Number of motes evaluated between two checks of the CPU budget of a run
+BUDGET_CHECK = 64
+
+# Nominal period [sec] of the readings of a mote (DATA_PERIOD of the sensor motes) : the weights of the EWMA and
+# CUSUM detectors are given per period, a reading received after dt seconds (send-on-delta) weighing dt / SAMPLE_PERIOD
+SAMPLE_PERIOD = 60
+
+# EWMA : weights of a new value (per SAMPLE_PERIOD) in the fast and in the slow averages, and margin [AQI] of the
+# fast one
+EWMA_FAST = 0.3
+EWMA_SLOW = 0.05
+EWMA_MARGIN = 10
+
+# CUSUM : weight of a new value in the reference average, deviation [AQI] tolerated, both per SAMPLE_PERIOD,
+# and alarm limit [AQI]
+CUSUM_WEIGHT = 0.05
+CUSUM_DRIFT = 5
+CUSUM_LIMIT = 50
+
+# Kalman : variance of the measurement noise [AQI^2], process noise of the level [AQI^2/sec] and of the trend
+# [AQI^2/sec^3], initial variance of the trend [AQI^2/sec^2]
+KALMAN_NOISE = 4
+KALMAN_LEVEL_NOISE = 0.01
+KALMAN_TREND_NOISE = 1e-6
+KALMAN_TREND_VARIANCE = 1e-2
+
+# Kalman : number of standard deviations of the estimated trend by which it must be over the threshold, the trend
+# of a noisy mote being uncertain
+KALMAN_CONFIDENCE = 3
+
+DETECTOR_CPU = REGISTRY.counter("server_detector_cpu_seconds_total", "CPU time used by a detector", ("detector",))
+DETECTOR_ALARMS = REGISTRY.counter("server_detector_alarms_total", "Motes found anomalous by a detector",
+                                   ("detector",))
+DETECTOR_BACKLOG = REGISTRY.gauge("server_detector_backlog", "Motes left for the next run of a detector, "
+                                  "its CPU budget being spent", ("detector",))
+DETECTOR_LATENCY = REGISTRY.histogram("server_detector_latency_seconds", "Time from the reception of the oldest "
+                                      "reading evaluated by a run of a detector to the end of the run",
+                                      [0.01, 0.03, 0.1, 0.3, 1, 3, 10, 30], ("detector",))
+
+
+class Detector:
+    """
+    Detector evaluating the motes from their windows in the store
+    """
+
+    name = None
+    # CPU time [sec] of a run
+    budget = 0.01
+
+    def __init__(self, threshold, min_values, budget=None):
+        """
+        :param threshold: minimum slope to trigger valves opening
+        :param min_values: minimum number of values of a mote to evaluate it
+        :param budget: CPU time [sec] of a run, None for the default budget of the detector
+        """
+        self.threshold = threshold
+        self.min_values = min_values
+        if budget is not None:
+            self.budget = budget
+        # Slots of the motes to evaluate, and reception time (time.monotonic) of their oldest reading
+        self.pending = set()
+        self.since = None
+
+    def add(self, slots, received):
+        """
+        Marks motes for the next run (server thread)
+        :param slots: slots of the motes that sent readings
+        :param received: reception time (time.monotonic) of the readings
+        :return: None
+        """
+        if not self.pending:
+            self.since = received
+        self.pending.update(slots)
+
+    def take(self):
+        """
+        Takes the motes to evaluate in the next run (server thread)
+        :return: list of the slots of the motes, and reception time of their oldest reading
+        """
+        slots, since = list(self.pending), self.since
+        self.pending.clear()
+        return slots, since
+
+    def run(self, store, slots):
+        """
+        Evaluates motes, until the CPU budget is spent (worker thread)
+        :param store: the store of the engine
+        :param slots: slots of the motes
+        :return: list of the keys of the anomalous motes, list of the slots not evaluated, and CPU time [sec] of the run
+        """
+        start = time.thread_time()
+        alarms = []
+        for i in range(0, len(slots), BUDGET_CHECK):
+            alarms += self.evaluate(store, slots[i:i + BUDGET_CHECK])
+            if time.thread_time() - start > self.budget:
+                return alarms, slots[i + BUDGET_CHECK:], time.thread_time() - start
+        return alarms, [], time.thread_time() - start
+
+    def evaluate(self, store, slots):
+        """
+        :param store: the store of the engine
+        :param slots: slots of motes
+        :return: list of the keys of the anomalous motes
+        """
+        return []
+
+
+class SlopeDetector(Detector):
+    name = "slope"
+    budget = 0.01
+
+    def evaluate(self, store, slots):
+        keys, count = store.keys, store.count
+        slots = [slot for slot in slots if keys[slot] is not None and count[slot] > self.min_values]
+        return [keys[slot] for slot in store.steep(slots, self.threshold)]
+
+
+class SequentialDetector(Detector):
+    """
+    Detector with a state per mote, updated with every value of the mote in order. The state is kept in columns
+    indexed by the slots of the store, and reset when a slot is given to another mote.
+    """
+
+    # Names of the columns of the state
+    STATE = ()
+
+    def __init__(self, threshold, min_values, budget=None):
+        super().__init__(threshold, min_values, budget)
+        self.keys = []           # slot -> key of the mote of the state
+        self.seen = array("I")   # slot -> time of the last value of the mote in the state
+        for name in self.STATE:
+            setattr(self, name, array("d"))
+
+    def _grow(self, capacity):
+        added = capacity - len(self.keys)
+        self.keys.extend([None] * added)
+        self.seen.extend(array("I", [0]) * added)
+        for name in self.STATE:
+            getattr(self, name).extend(array("d", [0]) * added)
+
+    def evaluate(self, store, slots):
+        if len(self.keys) < store.capacity:
+            self._grow(store.capacity)
+        window, times, values, lock = store.window, store.times, store.values, store.lock
+        alarms = []
+        for slot in slots:
+            # Copy of the window of the mote, consistent with the values added by the server
+            with lock:
+                key = store.keys[slot]
+                count, first = store.count[slot], store.first[slot]
+                base = slot * window
+                readings = [(times[base + (first + i) % window], values[base + (first + i) % window])
+                            for i in range(count)]
+            if key is None:
+                continue
+            if self.keys[slot] != key:
+                self.keys[slot] = key
+                self.seen[slot] = 0
+            seen = self.seen[slot]
+            for t, value in readings:
+                if t > seen:
+                    if seen == 0:
+                        self.reset(slot, value)
+                    else:
+                        self.update(slot, t - seen, value)
+                    seen = t
+            self.seen[slot] = seen
+            if count > self.min_values and self.anomalous(slot):
+                alarms.append(key)
+        return alarms
+
+    def reset(self, slot, value):
+        """
+        Starts the state of a mote
+        :param slot: slot of the mote
+        :param value: first value of the mote
+        """
+        pass
+
+    def update(self, slot, dt, value):
+        """
+        Updates the state of a mote with a new value
+        :param slot: slot of the mote
+        :param dt: time [sec] since the previous value
+        :param value: the new value
+        """
+        pass
+
+    def anomalous(self, slot):
+        """
+        :param slot: slot of a mote
+        :return: True if the state of the mote is anomalous
+        """
+        return False
+
+
+class EwmaDetector(SequentialDetector):
+    name = "ewma"
+    budget = 0.02
+    STATE = ("fast", "slow")
+
+    def reset(self, slot, value):
+        self.fast[slot] = self.slow[slot] = value
+
+    def update(self, slot, dt, value):
+        # Weights of a value standing for dt / SAMPLE_PERIOD readings
+        periods = dt / SAMPLE_PERIOD
+        self.fast[slot] += (1 - (1 - EWMA_FAST) ** periods) * (value - self.fast[slot])
+        self.slow[slot] += (1 - (1 - EWMA_SLOW) ** periods) * (value - self.slow[slot])
+
+    def anomalous(self, slot):
+        return self.fast[slot] - self.slow[slot] > EWMA_MARGIN
+
+
+class CusumDetector(SequentialDetector):
+    name = "cusum"
+    budget = 0.02
+    STATE = ("reference", "cusum")
+
+    def reset(self, slot, value):
+        self.reference[slot] = value
+        self.cusum[slot] = 0
+
+    def update(self, slot, dt, value):
+        # The deviation of a value standing for dt / SAMPLE_PERIOD readings is counted as many times
+        periods = dt / SAMPLE_PERIOD
+        reference = self.reference[slot]
+        self.cusum[slot] = max(0.0, self.cusum[slot] + (value - reference - CUSUM_DRIFT) * periods)
+        self.reference[slot] = reference + (1 - (1 - CUSUM_WEIGHT) ** periods) * (value - reference)
+
+    def anomalous(self, slot):
+        return self.cusum[slot] > CUSUM_LIMIT
+
+
+class KalmanDetector(SequentialDetector):
+    """
+    Local linear trend model : the level of a mote moves by its trend [per sec], both with a random walk,
+    and the values are the level with a measurement noise. The covariance of the state is kept in p00 (level),
+    p01 and p11 (trend).
+    """
+
+    name = "kalman"
+    budget = 0.05
+    STATE = ("level", "trend", "p00", "p01", "p11")
+
+    def reset(self, slot, value):
+        self.level[slot] = value
+        self.trend[slot] = 0
+        self.p00[slot] = KALMAN_NOISE
+        self.p01[slot] = 0
+        self.p11[slot] = KALMAN_TREND_VARIANCE
+
+    def update(self, slot, dt, value):
+        # Prediction
+        trend, p01, p11 = self.trend[slot], self.p01[slot], self.p11[slot]
+        level = self.level[slot] + trend * dt
+        p00 = self.p00[slot] + dt * (2 * p01 + dt * p11) + KALMAN_LEVEL_NOISE * dt
+        p01 += dt * p11
+        p11 += KALMAN_TREND_NOISE * dt
+        # Correction with the value
+        s = p00 + KALMAN_NOISE
+        k0, k1 = p00 / s, p01 / s
+        error = value - level
+        self.level[slot] = level + k0 * error
+        self.trend[slot] = trend + k1 * error
+        self.p00[slot] = (1 - k0) * p00
+        self.p01[slot] = (1 - k0) * p01
+        self.p11[slot] = p11 - k1 * p01
+
+    def anomalous(self, slot):
+        return self.trend[slot] - KALMAN_CONFIDENCE * math.sqrt(max(0.0, self.p11[slot])) > self.threshold
+
+
+DETECTORS = {detector.name: detector for detector in (SlopeDetector, EwmaDetector, CusumDetector, KalmanDetector)}
+
+
+class DetectorPool:
+    """
+    Runs detectors every DETECTOR_PERIOD, each in its own worker thread
+    """
+
+    def __init__(self, detectors, store):
+        """
+        :param detectors: the detectors
+        :param store: the store of the engine
+        """
+        self.detectors = detectors
+        self.store = store
+        self.executor = ThreadPoolExecutor(len(detectors), thread_name_prefix="detector")
+
+    async def run(self, on_alarm):
+        """
+        Runs the detectors until the server is stopped
+        :param on_alarm: function called with the key of an anomalous mote and the reception time of the oldest
+                         reading evaluated
+        :return: None
+        """
+        await asyncio.gather(*(self.schedule(detector, on_alarm) for detector in self.detectors))
+
+    async def schedule(self, detector, on_alarm):
+        loop = asyncio.get_running_loop()
+        cpu = DETECTOR_CPU.labels(detector.name)
+        alarms_total = DETECTOR_ALARMS.labels(detector.name)
+        backlog = DETECTOR_BACKLOG.labels(detector.name)
+        latency = DETECTOR_LATENCY.labels(detector.name)
+        while True:
+            await asyncio.sleep(DETECTOR_PERIOD)
+            if not detector.pending:
+                continue
+            slots, since = detector.take()
+            alarms, remaining, used = await loop.run_in_executor(self.executor, detector.run, self.store, slots)
+            cpu.inc(used)
+            alarms_total.inc(len(alarms))
+            backlog.value = len(remaining)
+            if remaining:
+                # Left for the next run, still as old
+                detector.add(remaining, since)
+                detector.since = min(detector.since, since)
+            else:
+                latency.observe(time.monotonic() - since)
+            for key in alarms:
+                on_alarm(key, since)
+
+    def close(self):
+        self.executor.shutdown(cancel_futures=True)
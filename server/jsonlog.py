@@ -0,0 +1,139 @@
+"""
+Logging of the server without blocking the reception of the readings : the records are put in a bounded queue,
+and formatted and written by a background thread. When the queue is full, the records are dropped and counted.
+The records are written as text, or as compact JSON lines : time, level, logger, message, and the fields given
+with extra={...} (for example the mote of the record), in a file rotated when it reaches LOG_FILE_SIZE.
+The forked processes (shards) write their records themselves, each one to its own file (see shard_logging).
+"""
+
+from logging.handlers import QueueHandler, QueueListener, RotatingFileHandler
+import json
+import logging
+import os
+import queue
+
+# Maximum number of records waiting to be written, the next ones being dropped
+LOG_QUEUE_SIZE = 10000
+
+# Size [bytes] of the log file from which it is rotated, and number of rotated files kept
+LOG_FILE_SIZE = 10 << 20
+LOG_FILE_BACKUPS = 5
+
+# Time [sec] the writer is given to write the last records at exit
+LOG_STOP_TIMEOUT = 2
+
+# Attributes of every record, the other ones being the fields given with extra
+RECORD_ATTRIBUTES = set(logging.makeLogRecord({}).__dict__) | {"message", "asctime"}
+
+# Path of the log file and JSON format of the records, given to setup_logging
+log_path = None
+log_json = False
+
+
+class JsonFormatter(logging.Formatter):
+    def format(self, record):
+        """
+        :param record: a record
+        :return: the record as a compact JSON object
+        """
+        line = {"t": round(record.created, 3), "level": record.levelname, "logger": record.name,
+                "msg": record.getMessage()}
+        for name, value in record.__dict__.items():
+            if name not in RECORD_ATTRIBUTES:
+                line[name] = value
+        if record.exc_info:
+            line["exc"] = self.formatException(record.exc_info)
+        return json.dumps(line, separators=(",", ":"), default=str)
+
+
+class DroppingQueueHandler(QueueHandler):
+    """
+    Puts the records in a bounded queue without waiting, dropping them when it is full
+    """
+
+    def __init__(self, records):
+        super().__init__(records)
+        self.dropped = 0
+
+    def prepare(self, record):
+        # Formatted by the writer thread : the arguments of the records of the server are immutable
+        return record
+
+    def enqueue(self, record):
+        try:
+            self.queue.put_nowait(record)
+        except queue.Full:
+            self.dropped += 1
+
+
+class WriterListener(QueueListener):
+    def stop(self):
+        """
+        Stops the writer after the last records, waiting at most LOG_STOP_TIMEOUT for room in the queue
+        and for the writer (a daemon thread, that doesn't keep the process alive)
+        :return: None
+        """
+        try:
+            self.queue.put(self._sentinel, timeout=LOG_STOP_TIMEOUT)
+        except queue.Full:
+            pass
+        self._thread.join(LOG_STOP_TIMEOUT)
+        self._thread = None
+
+
+def create_writer(path, json_lines):
+    """
+    :param path: path of the log file, rotated, None to write to stderr
+    :param json_lines: True to write JSON lines instead of text (always for a log file)
+    :return: the handler writing the records
+    """
+    if path is not None:
+        writer = RotatingFileHandler(path, maxBytes=LOG_FILE_SIZE, backupCount=LOG_FILE_BACKUPS)
+    else:
+        writer = logging.StreamHandler()
+    if path is not None or json_lines:
+        writer.setFormatter(JsonFormatter())
+    else:
+        writer.setFormatter(logging.Formatter("%(asctime)s %(levelname)s %(message)s"))
+    return writer
+
+
+def setup_logging(level, path=None, json_lines=False):
+    """
+    Sends the records of all the loggers to a background writer
+    :param level: minimum level of the records
+    :param path: path of the log file, rotated, None to write to stderr
+    :param json_lines: True to write JSON lines instead of text (always for a log file)
+    :return: the queue handler (counting the dropped records), and the listener writing the records,
+             to stop at exit to write the last ones
+    """
+    global log_path, log_json
+    log_path, log_json = path, json_lines
+    writer = create_writer(path, json_lines)
+    handler = DroppingQueueHandler(queue.Queue(LOG_QUEUE_SIZE))
+    root = logging.getLogger()
+    root.setLevel(level)
+    root.addHandler(handler)
+    listener = WriterListener(handler.queue, writer)
+    listener.start()
+
+    def after_fork():
+        # The writer thread is not in the forked processes (shards) : they write their records themselves,
+        # to stderr, or to their own log file once shard_logging is called
+        root.removeHandler(handler)
+        if path is None:
+            root.addHandler(writer)
+
+    os.register_at_fork(after_in_child=after_fork)
+    return handler, listener
+
+
+def shard_logging(index):
+    """
+    Sends the records of a forked process (shard) to its own log file, PATH.INDEX : a rotated file is written
+    by one process only
+    :param index: index of the shard
+    :return: None
+    """
+    if log_path is not None:
+        logging.getLogger().addHandler(create_writer("{}.{}".format(log_path, index), log_json))
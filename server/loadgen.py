@@ -0,0 +1,283 @@
+"""
+Load generator emulating the serial socket of a root mote, to benchmark the server without Cooja.
+It listens like the serial socket (server) of Cooja, and once the server is connected :
+- sends the readings of a number of motes in DATA frames, at a given rate, with duplicates (runicast ack losses),
+  debug lines and malformed frames (bad CRC, truncated frames, garbage);
+- acknowledges the OPEN and CONFIG commands of the server, and measures the decision latency : time between the sending
+  of the last reading of a mote and the reception of the OPEN command for this mote;
+- reports the readings accepted by the server (TCP backpressure), its CPU usage and the latency percentiles.
+
+Usage : python3 loadgen.py --spawn [options]     runs the server itself on the socket
+        python3 loadgen.py --pid PID [options]   waits for a server started separately (to measure its CPU usage)
+"""
+
+from Packet import *
+import argparse
+import asyncio
+import os
+import random
+import subprocess
+import sys
+import time
+
+# Records per DATA frame, as many as the root mote puts in a frame
+RECORDS_PER_FRAME = FRAME_MAX_PAYLOAD // DATA_RECORD.size
+
+# Period [sec] of the sending of the readings, and of the intermediate reports
+SEND_PERIOD = 0.01
+REPORT_PERIOD = 10
+MAX_CATCH_UP = 10
+
+
+def cpu_time(pid):
+    """
+    :param pid: pid of a process
+    :return: the CPU time [sec] used by the process (user and system) and its running children
+             (the shards of the server), from /proc
+    """
+    with open("/proc/{}/stat".format(pid)) as stat:
+        fields = stat.read().rpartition(")")[2].split()
+    total = (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+    try:
+        with open("/proc/{0}/task/{0}/children".format(pid)) as children:
+            for child in children.read().split():
+                total += cpu_time(int(child))
+    except OSError:
+        pass
+    return total
+
+
+def percentile(values, p):
+    """
+    :param values: sorted values
+    :param p: percentile, in [0, 100]
+    :return: the percentile of the values, None if there are none
+    """
+    if not values:
+        return None
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+class Mote:
+    """
+    Simulated sensor mote, sending values around a base value, rising for the drying motes
+    """
+
+    def __init__(self, address, args):
+        self.address = address
+        self.base = random.uniform(50, 300)
+        self.trend = args.trend if random.random() < args.rising else 0
+        self.noise = args.noise
+        self.uniform = args.distribution == "uniform"
+        self.last_sent = 0
+
+    def value(self, elapsed):
+        """
+        :param elapsed: time [sec] since the start of the load
+        :return: the next value of the mote (U.S. A.Q.I., from 0 to 500)
+        """
+        if self.uniform:
+            return random.randrange(501)
+        value = self.base + self.trend * elapsed + random.gauss(0, self.noise)
+        return max(0, min(500, round(value)))
+
+
+class LoadGenerator:
+    def __init__(self, args):
+        self.args = args
+        self.motes = [Mote(address, args) for address in range(1, args.motes + 1)]
+        self.sent = self.duplicates = self.malformed = self.debug = 0
+        self.opens = self.configs = 0
+        self.latencies = []
+        self.connected = asyncio.Event()
+        self.done = asyncio.Event()
+
+    async def handle(self, reader, writer):
+        """
+        Handles a connection of the server, until the end of the load
+        :return: None
+        """
+        print("Server connected")
+        self.connected.set()
+        receiver = asyncio.create_task(self.receive(reader, writer))
+        try:
+            await self.send(writer)
+        except ConnectionError:
+            print("Connection lost")
+        receiver.cancel()
+        writer.close()
+        self.done.set()
+
+    async def send(self, writer):
+        """
+        Sends the readings of the motes, round-robin, at the given rate
+        :param writer: stream to the server
+        :return: None
+        """
+        args = self.args
+        start = time.monotonic()
+        next_mote = 0
+        while True:
+            elapsed = time.monotonic() - start
+            if elapsed >= args.duration:
+                return
+            # At most MAX_CATCH_UP periods of readings at once, when the server is late
+            due = min(int(args.rate * elapsed) - self.sent, max(1, int(args.rate * SEND_PERIOD * MAX_CATCH_UP)))
+            records = []
+            for _ in range(due):
+                mote = self.motes[next_mote]
+                next_mote = (next_mote + 1) % len(self.motes)
+                record = DATA_RECORD.pack(mote.address, mote.value(elapsed), 0)
+                records.append(record)
+                if random.random() < args.duplicates:
+                    records.append(record)
+                    self.duplicates += 1
+                mote.last_sent = time.monotonic()
+            self.sent += due
+
+            frames = []
+            for i in range(0, len(records), RECORDS_PER_FRAME):
+                frames.append(encode_frame(DATA_PACKET, b"".join(records[i:i + RECORDS_PER_FRAME])))
+                if random.random() < args.malformed:
+                    frames.append(self.malformed_frame(records[i]))
+                    self.malformed += 1
+                if random.random() < args.debug:
+                    frames.append(b"Mote not in routing table.\n")
+                    self.debug += 1
+            writer.write(b"".join(frames))
+            # Waits for the server to read the readings : the achieved rate is the throughput of the server
+            await writer.drain()
+            await asyncio.sleep(SEND_PERIOD)
+
+    @staticmethod
+    def malformed_frame(record):
+        """
+        :param record: a DATA record
+        :return: a corrupted frame carrying the record
+        """
+        frame = bytearray(encode_frame(DATA_PACKET, record))
+        kind = random.randrange(3)
+        if kind == 0:
+            frame[-1] ^= 0xFF                 # bad CRC
+        elif kind == 1:
+            frame = frame[:-3] + b"\n"       # truncated frame
+        else:
+            frame = bytearray(random.randbytes(random.randrange(1, 16)))
+        return bytes(frame)
+
+    async def receive(self, reader, writer):
+        """
+        Acknowledges the OPEN and CONFIG commands of the server and measures the decision latency
+        :param reader: stream from the server
+        :param writer: stream to the server
+        :return: None
+        """
+        decoder = FrameDecoder()
+        motes = {mote.address: mote for mote in self.motes}
+        while True:
+            data = await reader.read(1 << 16)
+            if not data:
+                return
+            decoder.feed(data)
+            frames, _ = decoder.decode()
+            now = time.monotonic()
+            acks = []
+            for frame_type, payload in frames:
+                for packet in PackFactory.parse_frame(frame_type, payload):
+                    if packet.type == CONFIG_FRAME:
+                        self.configs += 1
+                        acks.append(AckPacket(packet.address, packet.command_id, ACK_DELIVERED))
+                        continue
+                    if packet.type != OPEN_PACKET:
+                        continue
+                    self.opens += 1
+                    mote = motes.get(packet.address)
+                    if mote is not None and mote.last_sent:
+                        self.latencies.append(now - mote.last_sent)
+                    acks.append(AckPacket(packet.address, packet.command_id, ACK_DELIVERED))
+                payload.release()
+            del frames
+            if acks:
+                writer.write(encode_packets(acks))
+
+    def report(self, elapsed, cpu):
+        """
+        Prints the statistics of the load
+        :param elapsed: time [sec] since the connection of the server
+        :param cpu: CPU time [sec] used by the server since its connection, None if unknown
+        :return: None
+        """
+        latencies = sorted(self.latencies)
+        print("{:.0f} s: {} readings ({:.0f}/s, {} duplicates, {} malformed frames, {} debug lines), "
+              "{} OPEN, {} CONFIG".format(elapsed, self.sent, self.sent / elapsed, self.duplicates, self.malformed,
+                                          self.debug, self.opens, self.configs))
+        if cpu is not None:
+            print("  server CPU: {:.1f} s ({:.0f} %)".format(cpu, 100 * cpu / elapsed))
+        if latencies:
+            print("  decision latency [ms]: p50 {:.2f}, p90 {:.2f}, p99 {:.2f}, max {:.2f}".format(
+                *(1000 * percentile(latencies, p) for p in (50, 90, 99, 100))))
+
+    async def run(self):
+        args = self.args
+        server = await asyncio.start_server(self.handle, "127.0.0.1", args.port)
+        process = None
+        pid = args.pid
+        if args.spawn:
+            command = [sys.executable, os.path.join(os.path.dirname(os.path.abspath(__file__)), "server.py"),
+                       "127.0.0.1:{}".format(args.port), "-t", str(args.threshold), "--log-level", "WARNING",
+                       "--shards", str(args.shards)] + (["--batch"] if args.batch else [])
+            if args.detectors:
+                command += ["--detectors", args.detectors]
+            if args.local_threshold:
+                command += ["--local-threshold", args.local_threshold]
+            process = subprocess.Popen(command, stdout=subprocess.DEVNULL)
+            pid = process.pid
+        print("Listening on port {}, {} motes, {} readings/s during {} s".format(
+            args.port, args.motes, args.rate, args.duration))
+
+        await self.connected.wait()
+        start = time.monotonic()
+        cpu_start = cpu_time(pid) if pid else None
+        while True:
+            try:
+                await asyncio.wait_for(self.done.wait(), REPORT_PERIOD)
+            except asyncio.TimeoutError:
+                pass
+            cpu = cpu_time(pid) - cpu_start if pid else None
+            self.report(time.monotonic() - start, cpu)
+            if self.done.is_set():
+                break
+
+        server.close()
+        if process is not None:
+            process.terminate()
+            process.wait()
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Load generator emulating the serial socket of a root mote")
+    parser.add_argument("--port", type=int, default=60001, help="port of the emulated serial socket")
+    parser.add_argument("--motes", type=int, default=1000, help="number of simulated motes")
+    parser.add_argument("--rate", type=float, default=1000, help="readings per second")
+    parser.add_argument("--duration", type=float, default=60, help="duration [sec] of the load")
+    parser.add_argument("--distribution", choices=("uniform", "trend"), default="trend",
+                        help="values uniform in [0, 500] as the motes, or around a base value with a trend")
+    parser.add_argument("--rising", type=float, default=0.01, help="fraction of motes whose values rise")
+    parser.add_argument("--trend", type=float, default=0.5, help="rise [per sec] of the values of rising motes")
+    parser.add_argument("--noise", type=float, default=2, help="standard deviation of the values")
+    parser.add_argument("--duplicates", type=float, default=0.01, help="fraction of readings sent twice")
+    parser.add_argument("--malformed", type=float, default=0.001, help="fraction of frames followed by a malformed one")
+    parser.add_argument("--debug", type=float, default=0.01, help="fraction of frames followed by a debug line")
+    parser.add_argument("--spawn", action="store_true", help="run the server on the emulated serial socket")
+    parser.add_argument("--threshold", type=float, default=0.1, help="slope threshold of the spawned server")
+    parser.add_argument("--shards", type=int, default=1, help="number of shards of the spawned server")
+    parser.add_argument("--batch", action="store_true", help="run the spawned server in batch decision mode")
+    parser.add_argument("--detectors", help="detectors of the spawned server, separated by commas")
+    parser.add_argument("--local-threshold", help="local threshold pushed by the spawned server to the motes")
+    parser.add_argument("--pid", type=int, help="pid of a server started separately, to measure its CPU usage")
+    args = parser.parse_args()
+
+    try:
+        asyncio.run(LoadGenerator(args).run())
+    except KeyboardInterrupt:
+        pass
@@ -0,0 +1,172 @@
+"""
+In-process metrics of the server, exposed in the Prometheus text format :
+- on a localhost HTTP endpoint (GET /metrics);
+- in periodic snapshots written to a file (replaced atomically).
+Counters and histograms are updated on the packet path, and must stay cheap : a metric with labels gives
+a child per combination of label values, to look up once and keep. Gauges can be collected when exposed.
+"""
+
+from bisect import bisect_left
+import asyncio
+import os
+
+
+def format_labels(names, values):
+    if not names:
+        return ""
+    return "{" + ",".join('{}="{}"'.format(name, value) for name, value in zip(names, values)) + "}"
+
+
+class Counter:
+    def __init__(self):
+        self.value = 0
+
+    def inc(self, amount=1):
+        self.value += amount
+
+
+class Histogram:
+    def __init__(self, buckets):
+        self.buckets = buckets
+        self.counts = [0] * (len(buckets) + 1)
+        self.sum = 0
+        self.count = 0
+
+    def observe(self, value):
+        self.counts[bisect_left(self.buckets, value)] += 1
+        self.sum += value
+        self.count += 1
+
+
+class Metric:
+    """
+    A metric, with a child per combination of the values of its labels
+    """
+
+    def __init__(self, kind, name, documentation, labels=(), child=Counter, collect=None):
+        """
+        :param kind: type of the metric : counter, gauge or histogram
+        :param name: name of the metric
+        :param documentation: description of the metric
+        :param labels: names of the labels of the metric
+        :param child: function creating a child
+        :param collect: function returning the list of the (label values, value) of the metric when it is exposed,
+                        None if the metric is updated by the server
+        """
+        self.kind = kind
+        self.name = name
+        self.documentation = documentation
+        self.label_names = labels
+        self.child = child
+        self.collect = collect
+        self.children = {}
+
+    def labels(self, *values):
+        """
+        :param values: values of the labels
+        :return: the child of the metric for these values
+        """
+        child = self.children.get(values)
+        if child is None:
+            child = self.children[values] = self.child()
+        return child
+
+    def inc(self, amount=1):
+        self.labels().inc(amount)
+
+    def set(self, value):
+        self.labels().value = value
+
+    def observe(self, value):
+        self.labels().observe(value)
+
+    def expose(self):
+        """
+        :return: the lines of the metric in the Prometheus text format
+        """
+        lines = ["# HELP {} {}".format(self.name, self.documentation), "# TYPE {} {}".format(self.name, self.kind)]
+        if self.collect is not None:
+            samples = self.collect()
+        else:
+            samples = list(self.children.items())
+        for values, child in samples:
+            labels = format_labels(self.label_names, values)
+            if self.kind != "histogram":
+                lines.append("{}{} {}".format(self.name, labels, child if self.collect else child.value))
+                continue
+            cumulative = 0
+            for bound, count in zip(child.buckets + [float("inf")], child.counts):
+                cumulative += count
+                bucket = format_labels(self.label_names + ("le",), values + ("+Inf" if bound == float("inf") else bound,))
+                lines.append("{}_bucket{} {}".format(self.name, bucket, cumulative))
+            lines.append("{}_sum{} {}".format(self.name, labels, child.sum))
+            lines.append("{}_count{} {}".format(self.name, labels, child.count))
+        return lines
+
+
+class Registry:
+    def __init__(self):
+        self.metrics = []
+
+    def register(self, metric):
+        self.metrics.append(metric)
+        return metric
+
+    def counter(self, name, documentation, labels=(), collect=None):
+        return self.register(Metric("counter", name, documentation, labels, collect=collect))
+
+    def gauge(self, name, documentation, labels=(), collect=None):
+        return self.register(Metric("gauge", name, documentation, labels, collect=collect))
+
+    def histogram(self, name, documentation, buckets, labels=()):
+        return self.register(Metric("histogram", name, documentation, labels, child=lambda: Histogram(buckets)))
+
+    def expose(self):
+        """
+        :return: all the metrics in the Prometheus text format
+        """
+        lines = []
+        for metric in self.metrics:
+            lines += metric.expose()
+        return "\n".join(lines) + "\n"
+
+    async def serve(self, port):
+        """
+        Serves the metrics on http://127.0.0.1:port/metrics
+        :param port: port of the endpoint
+        :return: the asyncio server
+        """
+        async def handle(reader, writer):
+            try:
+                request = await reader.readline()
+                while (await reader.readline()).strip():
+                    pass
+                if request.split()[1:2] == [b"/metrics"]:
+                    body = self.expose().encode()
+                    writer.write(b"HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                 b"Content-Length: " + str(len(body)).encode() + b"\r\n\r\n" + body)
+                else:
+                    writer.write(b"HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n")
+                await writer.drain()
+            except (ConnectionError, IndexError):
+                pass
+            finally:
+                writer.close()
+
+        return await asyncio.start_server(handle, "127.0.0.1", port)
+
+    async def snapshot(self, path, period):
+        """
+        Writes the metrics to a file every period
+        :param path: path of the file
+        :param period: period [sec] of the snapshots
+        :return: None
+        """
+        while True:
+            await asyncio.sleep(period)
+            with open(path + ".tmp", "w") as snapshot:
+                snapshot.write(self.expose())
+            os.replace(path + ".tmp", path)
+
+
+REGISTRY = Registry()
@@ -0,0 +1,161 @@
+"""
+Append-only binary log of the readings received by the server and of its OPEN decisions.
+The file is memory-mapped, and made of a header followed by fixed-size records, in reception order :
+- header : magic "RLOG", version (uint16), unused (uint16), number of records (uint64);
+- record : key of the mote (uint32), reception time (uint32, seconds), time (uint32, seconds), value (uint16),
+  type (uint8, DATA or OPEN), padding.
+The number of records is updated after each record is written, so a record is either complete or not counted.
+The time of a reading is the time it was read, up to the age of the readings batched by the sensor motes and
+buffered by the root mote before its reception : the records are not in time order, but in reception order,
+and they are found by their reception time (never decreasing, even if the clock is set back).
+
+Usage : python3 readinglog.py LOG [--mote ROOT/ADDRESS] [--start TIME] [--end TIME]
+        prints the records of the log received in a time range as CSV (time, root, address, type, value)
+"""
+
+from Packet import DATA_PACKET, OPEN_PACKET
+from array import array
+from bisect import bisect_left
+import argparse
+import mmap
+import os
+import struct
+import time
+
+LOG_MAGIC = b"RLOG"
+LOG_VERSION = 2
+LOG_HEADER = struct.Struct("<4sHHQ")
+LOG_RECORD = struct.Struct("<IIIHBx")
+
+# The file grows by at least LOG_GROWTH bytes, and at least doubles
+LOG_GROWTH = 1 << 20
+
+
+class ReadingLog:
+    def __init__(self, path):
+        """
+        Opens a log, creating it if needed, and builds the index of the records of every mote
+        :param path: path of the log file
+        """
+        self.path = path
+        self.file = open(path, "a+b")
+        size = os.fstat(self.file.fileno()).st_size
+        if size == 0:
+            self.file.truncate(LOG_GROWTH)
+        self.map = mmap.mmap(self.file.fileno(), 0)
+        if size == 0:
+            LOG_HEADER.pack_into(self.map, 0, LOG_MAGIC, LOG_VERSION, 0, 0)
+        magic, version, _, self.count = LOG_HEADER.unpack_from(self.map, 0)
+        if magic != LOG_MAGIC or version != LOG_VERSION:
+            self.close()
+            raise ValueError("{} is not a reading log of version {}".format(path, LOG_VERSION))
+
+        # Key of a mote -> numbers of its records, and reception time of the last record
+        self.index = {}
+        self.received = 0
+        with memoryview(self.map) as view:
+            records = view[LOG_HEADER.size:LOG_HEADER.size + self.count * LOG_RECORD.size]
+            for number, (key, received, _, _, _) in enumerate(LOG_RECORD.iter_unpack(records)):
+                numbers = self.index.get(key)
+                if numbers is None:
+                    numbers = self.index[key] = array("I")
+                numbers.append(number)
+                self.received = received
+            records.release()
+
+    def __len__(self):
+        return self.count
+
+    def _grow(self):
+        """
+        Makes the file bigger, to be able to append records
+        :return: None
+        """
+        size = len(self.map) + max(len(self.map), LOG_GROWTH)
+        self.map.flush()
+        self.map.close()
+        self.file.truncate(size)
+        self.map = mmap.mmap(self.file.fileno(), size)
+
+    def append(self, record_type, key, t, value=0):
+        """
+        Appends a record to the log, received now
+        :param record_type: DATA_PACKET for a reading, OPEN_PACKET for an OPEN decision
+        :param key: key of the mote
+        :param t: time of the record
+        :param value: value of the reading
+        :return: None
+        """
+        offset = LOG_HEADER.size + self.count * LOG_RECORD.size
+        if offset + LOG_RECORD.size > len(self.map):
+            self._grow()
+        self.received = max(self.received, round(time.time()))
+        LOG_RECORD.pack_into(self.map, offset, key, self.received, t, value, record_type)
+        numbers = self.index.get(key)
+        if numbers is None:
+            numbers = self.index[key] = array("I")
+        numbers.append(self.count)
+        self.count += 1
+        struct.pack_into("<Q", self.map, 8, self.count)
+
+    def record(self, number):
+        """
+        :param number: number of a record
+        :return: the (time, key, type, value) of the record
+        """
+        key, _, t, value, record_type = LOG_RECORD.unpack_from(self.map, LOG_HEADER.size + number * LOG_RECORD.size)
+        return t, key, record_type, value
+
+    def reception(self, number):
+        """
+        :param number: number of a record
+        :return: the reception time of the record
+        """
+        return struct.unpack_from("<I", self.map, LOG_HEADER.size + number * LOG_RECORD.size + 4)[0]
+
+    def query(self, start=0, end=None, key=None):
+        """
+        Gives the records received in a time range, found by bisection on their reception time (records are in
+        reception order, not in time order)
+        :param start: first reception time of the range
+        :param end: end of the range (excluded), None for no end
+        :param key: key of a mote to only give its records, None for the records of all the motes
+        :return: generator of the (time, key, type, value) of the records
+        """
+        numbers = range(self.count) if key is None else self.index.get(key, array("I"))
+        first = bisect_left(numbers, start, key=self.reception)
+        last = len(numbers) if end is None else bisect_left(numbers, end, first, key=self.reception)
+        for i in range(first, last):
+            yield self.record(numbers[i])
+
+    def flush(self):
+        self.map.flush()
+
+    def close(self):
+        self.map.flush()
+        self.map.close()
+        self.file.close()
+
+
+def parse_mote(mote):
+    """
+    :param mote: a mote, ROOT/ADDRESS
+    :return: the key of the mote
+    """
+    root, _, address = mote.partition("/")
+    return (int(root) << 16) | int(address)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Prints the records of a reading log as CSV")
+    parser.add_argument("log", help="path of the log")
+    parser.add_argument("--mote", type=parse_mote, metavar="ROOT/ADDRESS", help="only print the records of a mote")
+    parser.add_argument("--start", type=int, default=0, help="first reception time of the records")
+    parser.add_argument("--end", type=int, help="end reception time (excluded) of the records")
+    args = parser.parse_args()
+
+    log = ReadingLog(args.log)
+    names = {DATA_PACKET: "DATA", OPEN_PACKET: "OPEN"}
+    for t, key, record_type, value in log.query(args.start, args.end, args.mote):
+        print("{},{},{},{},{}".format(t, key >> 16, key & 0xFFFF, names.get(record_type, record_type), value))
+    log.close()
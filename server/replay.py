@@ -0,0 +1,227 @@
+"""
+Offline replay of a trace of readings through the decision engine of the server, as fast as possible.
+The readings carry their time in the trace, used as simulated time instead of the time of reception.
+The trace is one of :
+- a reading log of the server (--log);
+- a CSV file of TIME,ADDRESS,VALUE lines, the address being ADDRESS or ROOT/ADDRESS (--csv), or the output of
+  readinglog.py (TIME,ROOT,ADDRESS,TYPE,VALUE lines);
+- a synthetic trace of motes sending a value every period, some of them rising from a random time (--synthetic),
+  or with --delta only the values that must be reported, as the sensor motes do with send-on-delta.
+
+Usage : python3 replay.py (--log LOG | --csv CSV | --synthetic) [--threshold T] [--window N] [options]
+"""
+
+from Packet import DATA_PACKET, DataPacket
+from detectors import DETECTOR_PERIOD, DETECTORS
+from readinglog import LOG_HEADER, LOG_RECORD, ReadingLog, parse_mote
+from server import DECISION_PERIOD, DecisionEngine, TICK_PERIOD, WINDOW_SIZE
+import argparse
+import random
+import time
+
+
+def log_trace(path):
+    """
+    :param path: path of a reading log
+    :return: generator of the (time, key, value) of the readings of the log
+    """
+    log = ReadingLog(path)
+    with memoryview(log.map) as view:
+        records = view[LOG_HEADER.size:LOG_HEADER.size + len(log) * LOG_RECORD.size]
+        for key, _, t, value, record_type in LOG_RECORD.iter_unpack(records):
+            if record_type == DATA_PACKET:
+                yield t, key, value
+        records.release()
+    log.close()
+
+
+def csv_trace(path):
+    """
+    :param path: path of a CSV trace
+    :return: generator of the (time, key, value) of the readings of the trace
+    """
+    with open(path) as trace:
+        for line in trace:
+            fields = line.strip().split(",")
+            try:
+                if len(fields) == 3:
+                    yield int(fields[0]), parse_mote(fields[1]) if "/" in fields[1] else int(fields[1]), int(fields[2])
+                elif len(fields) == 5 and fields[3] == "DATA":
+                    yield int(fields[0]), (int(fields[1]) << 16) | int(fields[2]), int(fields[4])
+            except ValueError:
+                # Header or malformed line
+                continue
+
+
+def synthetic_trace(args):
+    """
+    Generates the readings of motes sending a value around a base value every period, a fraction of them
+    rising from a random time. With send-on-delta, a mote only sends a value that differs by args.delta from its
+    last sent value, or half of it against the direction of its last sent change, or after args.heartbeat seconds
+    (as must_report and report_sent of the sensor motes).
+    :param args: parameters of the trace
+    :return: generator of the (time, key, value) of the readings in time order, the time at which
+             each rising mote starts rising, and the list of the number of values not sent (send-on-delta)
+    """
+    start = 1 << 30
+    duration = int(args.hours * 3600)
+    # Networks of 1000 motes, each mote sending at its own offset in the period
+    motes = []
+    onsets = {}
+    for i in range(args.motes):
+        key = ((i // 1000) << 16) | (i % 1000 + 1)
+        base = random.randrange(50, 300)
+        offset = random.randrange(args.period)
+        if random.random() < args.rising:
+            onsets[key] = start + random.randrange(duration * 9 // 10)
+        motes.append((offset, key, base))
+    motes.sort()
+    noise = [round(random.gauss(0, args.noise)) for _ in range(4093)]
+    trend = args.trend / 60
+    # key -> last sent value, its time and the sign of the last sent change
+    sent = {}
+    skipped = [0]
+    delta, half = args.delta, (args.delta + 1) // 2
+
+    def readings():
+        i = 0
+        for period_start in range(start, start + duration, args.period):
+            for offset, key, base in motes:
+                t = period_start + offset
+                value = base + noise[i % len(noise)]
+                i += 1
+                onset = onsets.get(key)
+                if onset is not None and t > onset:
+                    value += int(trend * (t - onset))
+                value = max(0, min(500, value))
+                if delta:
+                    last = sent.get(key)
+                    if last is not None:
+                        diff = value - last[0]
+                        turned = diff >= half and last[2] < 0 or diff <= -half and last[2] > 0
+                        if abs(diff) < delta and not turned and t - last[1] < args.heartbeat:
+                            skipped[0] += 1
+                            continue
+                        # The trend only follows changes of at least half of delta (as report_sent)
+                        sent[key] = (value, t, (diff >= half) - (diff <= -half) or last[2])
+                    else:
+                        sent[key] = (value, t, 0)
+                yield t, key, value
+
+    return readings(), onsets, skipped
+
+
+def percentiles(values):
+    """
+    :param values: list of values
+    :return: the p50, p90, p99 and max of the values, as text
+    """
+    if not values:
+        return "-"
+    values = sorted(values)
+    return "p50 {}, p90 {}, p99 {}, max {}".format(
+        *(values[min(len(values) - 1, len(values) * p // 100)] for p in (50, 90, 99, 100)))
+
+
+def replay(trace, engine):
+    """
+    Feeds a trace through the decision engine, expiring the motes every TICK_PERIOD of simulated time
+    (and making the decisions every DECISION_PERIOD in batch mode, or with the detectors every DETECTOR_PERIOD)
+    :param trace: iterable of the (time, key, value) of the readings, in time order
+    :param engine: the decision engine
+    :return: number of readings, number of OPEN decisions, time of the first reading and of the first OPEN
+             of each mote
+    """
+    readings = opens = 0
+    first_reading, first_open = {}, {}
+    next_tick = next_decision = 0
+    for t, key, value in trace:
+        readings += 1
+        if t >= next_tick:
+            engine.expire_motes(t)
+            next_tick = t + TICK_PERIOD
+        if engine.batch and t >= next_decision:
+            for mote, _ in engine.decide(t):
+                opens += 1
+                if mote not in first_open:
+                    first_open[mote] = t
+            next_decision = t + DECISION_PERIOD
+        if engine.detectors and t >= next_decision:
+            # The detectors run one after the other, without CPU budget
+            alarms = set()
+            for detector in engine.detectors:
+                alarms.update(detector.evaluate(engine.store, detector.take()[0]))
+            for mote in alarms:
+                slot = engine.store.index.get(mote)
+                if slot is not None and engine.open_valve(slot, t):
+                    opens += 1
+                    if mote not in first_open:
+                        first_open[mote] = t
+            next_decision = t + DETECTOR_PERIOD
+        if key not in first_reading:
+            first_reading[key] = t
+        if engine.handle_received_data(key, DataPacket(key & 0xFFFF, value, t)):
+            opens += 1
+            if key not in first_open:
+                first_open[key] = t
+        elif engine.batch or engine.detectors:
+            engine.flush(t)
+    return readings, opens, first_reading, first_open
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Replays a trace of readings through the decision engine")
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--log", help="reading log of the server")
+    source.add_argument("--csv", help="CSV trace, TIME,ADDRESS,VALUE lines")
+    source.add_argument("--synthetic", action="store_true", help="synthetic trace")
+    parser.add_argument("-t", "--threshold", type=float, default=0.1, help="minimum slope to trigger valves opening")
+    parser.add_argument("--window", type=int, default=WINDOW_SIZE, help="number of values kept for the regression")
+    parser.add_argument("--motes", type=int, default=10000, help="number of motes of the synthetic trace")
+    parser.add_argument("--hours", type=float, default=24, help="duration of the synthetic trace")
+    parser.add_argument("--period", type=int, default=60, help="period [sec] of the readings of the synthetic trace")
+    parser.add_argument("--rising", type=float, default=0.01, help="fraction of rising motes in the synthetic trace")
+    parser.add_argument("--trend", type=float, default=10, help="rise [per min] of the values of rising motes")
+    parser.add_argument("--noise", type=float, default=2, help="standard deviation of the values")
+    parser.add_argument("--delta", type=int, default=0,
+                        help="send-on-delta : change of the values of a mote sent in the synthetic trace, 0 for all")
+    parser.add_argument("--heartbeat", type=int, default=180,
+                        help="send-on-delta : maximum time [sec] between two values of a mote in the synthetic trace")
+    parser.add_argument("--seed", type=int, help="seed of the synthetic trace, to replay the same one again")
+    parser.add_argument("--batch", action="store_true", help="make the decisions every DECISION_PERIOD")
+    parser.add_argument("--detectors", type=lambda names: names.split(","), default=[],
+                        help="detectors making the decisions every DETECTOR_PERIOD, among " + ",".join(DETECTORS))
+    args = parser.parse_args()
+    random.seed(args.seed)
+
+    onsets = {}
+    skipped = [0]
+    if args.log:
+        trace = log_trace(args.log)
+    elif args.csv:
+        trace = csv_trace(args.csv)
+    else:
+        trace, onsets, skipped = synthetic_trace(args)
+    rising = set(onsets)
+
+    engine = DecisionEngine(args.threshold, window=args.window, batch=args.batch, detectors=args.detectors)
+    start = time.perf_counter()
+    readings, opens, first_reading, first_open = replay(trace, engine)
+    elapsed = time.perf_counter() - start
+
+    print("{} readings of {} motes in {:.1f} s ({:.0f} readings/s, {:.2f} us of CPU per reading)".format(
+        readings, len(first_reading), elapsed, readings / elapsed if elapsed else 0, 1e6 * elapsed / readings))
+    if args.delta:
+        print("{} readings not sent (send-on-delta), {:.1f} % of the readings".format(
+            skipped[0], 100 * skipped[0] / (readings + skipped[0])))
+    print("{} OPEN decisions, for {} motes".format(opens, len(first_open)))
+    if rising:
+        latencies = [t - onsets[key] for key, t in first_open.items() if key in rising]
+    else:
+        latencies = [t - first_reading[key] for key, t in first_open.items()]
+    if rising:
+        print("Rising motes : {} opened, {} missed, {} other motes opened".format(
+            len(rising & first_open.keys()), len(rising - first_open.keys()), len(first_open.keys() - rising)))
+        print("Decision latency [simulated sec] since the start of the rise : {}".format(percentiles(latencies)))
+    else:
+        print("Time [simulated sec] from the first reading to the first OPEN : {}".format(percentiles(latencies)))
@@ -1,126 +1,936 @@
 from Packet import *
-import socket
-import sys
+from detectors import DETECTORS, DetectorPool
+from jsonlog import setup_logging, shard_logging
+from metrics import REGISTRY
+from readinglog import ReadingLog
+from shards import ShardedEngine
+from store import MoteStore
+from collections import OrderedDict
+import argparse
+import asyncio
+import heapq
+import logging
+import signal
+import time
 
+# Maximum number of times an OPEN command is sent to the root mote
+MAX_OPEN_ATTEMPTS = 3
 
-class Server:
-    def __init__(self, threshold=5, router_ip="127.0.0.1", router_port=60001):
-        self.values = {}
-        self.last_received = {}
+# Time [sec] after which an OPEN command that hasn't been acknowledged by the root mote is sent again
+ACK_TIMEOUT = 30
+
+# Time [sec] a delivered command is remembered : the root mote retries it on a route miss until TIMEOUT_PENDING_OPEN
+# (30 s) after its delivery, then for OPEN_RETRY_DELAY * MAX_OPEN_RETRIES (15 s), and may acknowledge it again
+# with ACK_NO_ROUTE
+DELIVERED_TIMEOUT = 60
+
+# Time [sec] to wait before connecting again to a root mote, doubled after each failure up to RECONNECT_MAX_DELAY
+RECONNECT_DELAY = 1
+RECONNECT_MAX_DELAY = 60
+
+# Period [sec] of the maintenance of the server (retries of the OPEN commands, expiry of the motes)
+TICK_PERIOD = 1
+
+# Period [sec] of the decisions in batch mode, for all the motes that sent a reading since the last decisions
+DECISION_PERIOD = 1
+
+# Time [sec] after which a mote that did not send any data is forgotten
+MOTE_TIMEOUT = 30*60
+
+# Number of values of a mote kept for the regression, and minimum number of values to compute a relevant slope
+WINDOW_SIZE = 30
+MIN_VALUES = 10
+
+# Time [sec] covered by the regression : older values are evicted, the motes sending on delta being irregular
+WINDOW_TIME = 30*60
+
+# Time [sec] during which the same value received again from a mote is a duplicate (due to runicast ack losses)
+DUPLICATE_DELAY = 15
+
+# Period [sec] of the snapshots of the metrics
+METRICS_SNAPSHOT_PERIOD = 60
+
+# Time [sec] a valve stays open after an OPEN command (OPEN_TIME of the sensor motes)
+VALVE_OPEN_TIME = 600
+
+# Time [sec] before the closing of a valve from which it is opened again if the slope is still high
+OPEN_RENEWAL = 60
+
+# Fraction of the threshold over which the slope must stay to keep a valve open (hysteresis)
+HYSTERESIS = 0.5
+
+# Maximum rate [per sec] of the OPEN commands sent to a root mote, and maximum burst (token bucket), the CONFIG
+# commands being sent after the OPEN ones within the same limit
+OPEN_RATE = 10
+OPEN_BURST = 20
+
+# Period [sec] after which the local threshold is pushed again to the motes (a rebooted mote forgot it)
+CONFIG_REFRESH = 3600
+
+logger = logging.getLogger("server")
+
+READINGS = REGISTRY.counter("server_readings_total", "DATA readings received from a root mote", ("root",))
+FRAME_ERRORS = REGISTRY.counter("server_frame_errors_total", "Frames dropped for a bad length or CRC", ("root",))
+OPENS_SENT = REGISTRY.counter("server_open_sent_total", "OPEN commands sent to a root mote, retries included",
+                              ("root",))
+OPENS_THROTTLED = REGISTRY.counter("server_open_throttled_total", "OPEN commands delayed by the rate limit of "
+                                   "a root mote", ("root",))
+CONFIGS_SENT = REGISTRY.counter("server_config_sent_total", "CONFIG commands sent to a root mote, retries included",
+                               ("root",))
+LOCAL_OPENS = REGISTRY.counter("server_local_opens_total", "Valves opened by the sensor motes themselves", ("root",))
+OPEN_ACKS = REGISTRY.counter("server_open_acks_total", "Acknowledgements of OPEN commands by a root mote",
+                             ("root", "status"))
+COMMAND_TIMEOUTS = REGISTRY.counter("server_command_timeouts_total", "OPEN and CONFIG commands not acknowledged by "
+                                    "a root mote after ACK_TIMEOUT seconds", ("root",))
+ROOT_DROPPED = REGISTRY.counter("root_ingress_dropped_total", "Readings dropped by a root mote, its buffer being full",
+                                ("root",))
+ROOT_BUFFERED = REGISTRY.gauge("root_ingress_max_buffered", "Maximum number of readings buffered by a root mote "
+                               "during its last STATS period", ("root",))
+PROCESSING_TIME = REGISTRY.histogram("server_processing_seconds", "Time to handle the frames of a received chunk",
+                                     [0.0001, 0.0003, 0.001, 0.003, 0.01, 0.03, 0.1, 0.3])
+OPEN_LATENCY = REGISTRY.histogram("server_open_latency_seconds", "Time from the reception of the reading that decided "
+                                  "an OPEN to its delivery acknowledged by the root mote",
+                                  [0.01, 0.03, 0.1, 0.3, 1, 3, 10, 30, 100])
+ACK_STATUSES = {ACK_DELIVERED: "delivered", ACK_FAILED: "failed", ACK_NO_ROUTE: "no_route",
+                ACK_QUEUE_FULL: "queue_full"}
+
+
+def mote_key(root, address):
+    """
+    Identifies a mote among all the networks handled by the server, addresses being only unique in their network
+    :param root: index of the root mote of the network of the mote
+    :param address: address of the mote in its network
+    :return: the key of the mote
+    """
+    return (root << 16) | address
+
+
+def mote_name(key):
+    """
+    :param key: key of a mote
+    :return: readable name of the mote, ROOT/ADDRESS
+    """
+    return "{}/{}".format(key >> 16, key & 0xFFFF)
+
+
+class DecisionEngine:
+    """
+    Decides from the data of the motes of all the networks which valves must be opened
+    """
+
+    def __init__(self, threshold=5, log=None, window=WINDOW_SIZE, batch=False, detectors=()):
+        """
+        :param threshold: minimum slope to trigger valves opening
+        :param log: ReadingLog where the readings and the decisions are appended, None to keep them only in memory
+        :param window: number of values of a mote kept for the regression
+        :param batch: True to make the decisions in decide, for all the motes that changed since its last call,
+                      instead of on every reading
+        :param detectors: names of the detectors making the decisions (see detectors.py), run by a DetectorPool
+                          on the store, instead of the slope on every reading
+        """
+        self.store = MoteStore(window, horizon=WINDOW_TIME)
         self.threshold = threshold
-        self.router_ip = router_ip
-        self.router_port = router_port
-        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
-        self.sock.connect((self.router_ip, self.router_port))
+        self.log = log
+        self.batch = batch
+        self.detectors = [DETECTORS[name](threshold, MIN_VALUES) for name in detectors]
+        # Batch mode : slots changed by the current chunk, and slot -> reception time (time.monotonic)
+        # of the oldest reading of the slot not decided yet
+        self.changed = []
+        self.dirty = {}
+        # Min-heap of (last reception time, key), one entry per mote, possibly older than its last reception
+        self.expiry = []
+        self.evicted = 0
+        self.duplicates = 0
+        # OPEN decisions not sent, the valve being already open
+        self.suppressed = 0
 
-    def handle_received_data(self, packet):
+    def add_reading(self, mote, t, value):
+        """
+        Adds a reading to the window of a mote
+        :param mote: key of the mote
+        :param t: reception time of the reading
+        :param value: the reading
+        :return: the slot of the mote, None if the reading is a duplicate
+        """
+        store = self.store
+        slot = store.index.get(mote)
+        if slot is None:
+            heapq.heappush(self.expiry, (t, mote))
+            slot = store.slot(mote)
+
+        store.last_received[slot] = t
+
+        # Check if the data is a duplicate (due to runicast ack losses), or older than the last reading
+        # (batch of readings received twice)
+        last = store.last(slot)
+        if last is not None and (t < last[0] or value == last[1] and t - DUPLICATE_DELAY < last[0]):
+            self.duplicates += 1
+            return None
+
+        store.add(slot, t, value)
+        return slot
+
+    def handle_received_data(self, mote, packet):
         """
         Interprets the received data packet
+        :param mote: key of the mote that sent the packet
         :param packet: received data packet
+        :return: True if the valve of the mote must be opened, False otherwise
+        """
+        return self.handle_reading(mote, packet.time, packet.data)
+
+    def handle_reading(self, mote, t, value):
+        """
+        Interprets a reading
+        :param mote: key of the mote that sent the reading
+        :param t: reception time of the reading
+        :param value: the reading
+        :return: True if the valve of the mote must be opened, False otherwise
+        """
+        slot = self.add_reading(mote, t, value)
+        if slot is None:
+            return False
+        if self.log is not None:
+            self.log.append(DATA_PACKET, mote, t, value)
+        if self.batch or self.detectors:
+            self.changed.append(slot)
+            return False
+
+        if self.store.count[slot] > MIN_VALUES:
+            return self.decide_valve(slot, t, self.compute_slope(mote))
+        return False
+
+    def open_valve(self, slot, t):
+        """
+        Decides if an OPEN command must be sent to a mote found anomalous : no OPEN is sent while its valve
+        is open, until OPEN_RENEWAL seconds before it closes
+        :param slot: slot of the mote
+        :param t: current time
+        :return: True if an OPEN command must be sent to the mote, False otherwise
+        """
+        store = self.store
+        if t + OPEN_RENEWAL < store.open_until[slot]:
+            self.suppressed += 1
+            return False
+        store.open_until[slot] = t + VALVE_OPEN_TIME
+        if self.log is not None:
+            self.log.append(OPEN_PACKET, store.keys[slot], t)
+        return True
+
+    def decide_valve(self, slot, t, slope):
+        """
+        Decides if an OPEN command must be sent to a mote, from the state of its valve :
+        - a closed valve is opened if the slope is over the threshold;
+        - an open valve is opened again when it is about to close (OPEN_RENEWAL), if the slope is still
+          over HYSTERESIS times the threshold;
+        - no OPEN is sent before, the valve staying open VALVE_OPEN_TIME seconds.
+        :param slot: slot of the mote
+        :param t: time of the last reading of the mote
+        :param slope: slope of the regression of the values of the mote
+        :return: True if an OPEN command must be sent to the mote, False otherwise
+        """
+        if slope <= self.threshold and not (t < self.store.open_until[slot] and slope > self.threshold * HYSTERESIS):
+            return False
+        return self.open_valve(slot, t)
+
+    def valve_failed(self, mote):
+        """
+        Forgets that the valve of a mote is open, its OPEN command having failed, so that it is sent again
+        on the next reading over the threshold
+        :param mote: key of the mote
         :return: None
         """
-        values_list = self.values.get(packet.address, [])
+        slot = self.store.index.get(mote)
+        if slot is not None:
+            self.store.open_until[slot] = 0
 
-        self.last_received[packet.address] = packet.time
+    def valve_opened(self, mote, t):
+        """
+        Records that a sensor mote opened its valve itself, so that no OPEN is sent to it before it closes
+        :param mote: key of the mote
+        :param t: current time
+        :return: None
+        """
+        slot = self.store.index.get(mote)
+        if slot is not None:
+            self.store.open_until[slot] = max(self.store.open_until[slot], t + VALVE_OPEN_TIME)
 
-        # Check if the data is a duplicate (due to runicast ack losses)
-        if len(values_list) > 0 and packet.data == values_list[-1][1] and packet.time - 15 < values_list[-1][0]:
-            return
+    def flush(self, received):
+        """
+        Called after the frames of a received chunk are handled : in batch mode or with detectors, the motes
+        of the chunk are marked for the next decisions
+        :param received: reception time (time.monotonic) of the chunk
+        :return: None
+        """
+        if self.changed:
+            if self.batch:
+                dirty = self.dirty
+                for slot in self.changed:
+                    if slot not in dirty:
+                        dirty[slot] = received
+            for detector in self.detectors:
+                detector.add(self.changed, received)
+            self.changed.clear()
 
-        # Circular buffer, if already 30 values, remove oldest
-        if len(values_list) >= 30:
-            values_list = values_list[1:]
+    def decide(self, t):
+        """
+        Batch mode : decides for all the motes that sent a reading since the last call, in one pass
+        :param t: current time, logged with the decisions
+        :return: list of the (key, reception time of the oldest reading not decided yet) of the motes whose
+                 valve must be opened
+        """
+        store = self.store
+        keys, count = store.keys, store.count
+        slots = [slot for slot in self.dirty if keys[slot] is not None and count[slot] > MIN_VALUES]
+        # Only the motes over the lower threshold of the hysteresis may have to be opened
+        opens = [(keys[slot], self.dirty[slot]) for slot in store.steep(slots, self.threshold * HYSTERESIS)
+                 if self.decide_valve(slot, t, int(store.slope(slot) * 100) / 100)]
+        self.dirty.clear()
+        return opens
 
-        values_list.append((packet.time, packet.data))
-        self.values[packet.address] = values_list
+    def nb_motes(self):
+        """
+        :return: the number of motes followed by the engine
+        """
+        return len(self.store)
 
-        # There must be at least 10 values from a node to compute a relevant slope
-        if len(values_list) > 10 and self.compute_slope(packet.address) > self.threshold:
-            print("Sending OPEN message to node [{node}]".format(node=packet.address))
-            self.send_packet(OpenPacket(packet.address))
+    def warm(self, now):
+        """
+        Fills the windows of the motes with the readings received for MOTE_TIMEOUT seconds, after a restart,
+        and restores the valves opened by the OPEN decisions since then, so that no OPEN is sent to them again
+        before OPEN_RENEWAL
+        :param now: current time
+        :return: the number of replayed readings
+        """
+        replayed = 0
+        for t, mote, record_type, value in self.log.query(now - MOTE_TIMEOUT):
+            if record_type == DATA_PACKET:
+                self.add_reading(mote, t, value)
+                replayed += 1
+            elif record_type == OPEN_PACKET:
+                self.valve_opened(mote, t)
+        return replayed
 
-    def compute_slope(self, node):
+    def compute_slope(self, mote):
         """
         Computes slope of the least square regression of the data sent by a node
-        :param node: node we want to compute the regression for
+        :param mote: key of the node we want to compute the regression for
         :return: the slope of the regression
         """
-        values = self.values.get(node, [])
-        slope = least_squares_slope(values)
+        slope = self.store.slope(self.store.index[mote])
         return (int(slope * 100)) / 100
 
+    def expire_motes(self, now):
+        """
+        Removes the nodes that did not send any data for MOTE_TIMEOUT seconds.
+        Only the entries of the heap older than the timeout are looked at : an entry of a mote that sent data
+        since is pushed again with its last reception time, so a mote costs at most one look per timeout period.
+        :param now: current time
+        :return: the number of removed nodes
+        """
+        store = self.store
+        limit = now - MOTE_TIMEOUT
+        evicted = self.evicted
+        while self.expiry and self.expiry[0][0] < limit:
+            _, mote = self.expiry[0]
+            last_received = store.last_received[store.index[mote]]
+            if last_received < limit:
+                heapq.heappop(self.expiry)
+                store.remove(mote)
+                self.evicted += 1
+            else:
+                heapq.heapreplace(self.expiry, (last_received, mote))
+        return self.evicted - evicted
+
+
+class RootConnection(asyncio.BufferedProtocol):
+    """
+    Connection to the serial socket of a root mote, connected again when it is lost.
+    The bytes are received directly in the buffer of the frame decoder.
+    """
+
+    def __init__(self, engine, index, ip, port, local_threshold=None):
+        """
+        :param local_threshold: slope [centi-AQI per minute] over which the sensor motes open their valve
+                                themselves, pushed to every mote in a CONFIG command, None to push nothing
+        """
+        self.engine = engine
+        self.index = index
+        self.ip = ip
+        self.port = port
+        self.transport = None
+        self.closed = None
+        self.decoder = FrameDecoder()
+        # Commands waiting for their acknowledgement :
+        # id -> [OpenPacket or ConfigPacket, attempts, reception of the reading (None for a CONFIG)]
+        self.commands = {}
+        # Commands delivered by the root mote, which may still fail without route : id -> (type, address, delivery)
+        self.delivered = {}
+        self.next_command_id = 1
+        # Token bucket of the commands, and OPEN commands delayed by it : address -> reception of the reading
+        self.tokens = OPEN_BURST
+        self.refilled = time.monotonic()
+        self.throttled = OrderedDict()
+        # Motes the local threshold was pushed to (or is being pushed to), and CONFIG commands delayed by the
+        # token bucket, sent after the OPEN ones : address -> None
+        self.local_threshold = local_threshold
+        self.configured = set()
+        self.configured_at = time.monotonic()
+        self.configs = OrderedDict()
+        root = str(index)
+        self.readings = READINGS.labels(root)
+        self.frame_errors = FRAME_ERRORS.labels(root)
+        self.opens_sent = OPENS_SENT.labels(root)
+        self.opens_throttled = OPENS_THROTTLED.labels(root)
+        self.configs_sent = CONFIGS_SENT.labels(root)
+        self.local_opens = LOCAL_OPENS.labels(root)
+        self.acks = {status: OPEN_ACKS.labels(root, name) for status, name in ACK_STATUSES.items()}
+        self.command_timeouts = COMMAND_TIMEOUTS.labels(root)
+
+    def __str__(self):
+        return "Root {} ({}:{})".format(self.index, self.ip, self.port)
+
+    async def run(self):
+        """
+        Connects to the root mote, and connects again each time the connection is lost or fails
+        :return: None
+        """
+        loop = asyncio.get_running_loop()
+        delay = RECONNECT_DELAY
+        while True:
+            self.closed = loop.create_future()
+            try:
+                await loop.create_connection(lambda: self, self.ip, self.port)
+            except OSError as error:
+                logger.warning("%s: connection failed (%s), retrying in %s s", self, error, delay)
+                await asyncio.sleep(delay)
+                delay = min(2 * delay, RECONNECT_MAX_DELAY)
+                continue
+            delay = RECONNECT_DELAY
+            await self.closed
+            logger.warning("%s: connection lost, reconnecting in %s s", self, delay)
+            await asyncio.sleep(delay)
+
+    def connection_made(self, transport):
+        logger.info("%s: connected", self)
+        self.transport = transport
+        self.decoder = FrameDecoder()
+
+    def connection_lost(self, exc):
+        self.transport = None
+        if not self.closed.done():
+            self.closed.set_result(exc)
+
+    def get_buffer(self, sizehint):
+        return self.decoder.get_buffer()
+
+    def buffer_updated(self, nbytes):
+        start = time.perf_counter()
+        decoder = self.decoder
+        errors = decoder.errors
+        decoder.buffer_updated(nbytes)
+        self.handle_frames(*decoder.decode())
+        self.frame_errors.inc(decoder.errors - errors)
+        PROCESSING_TIME.observe(time.perf_counter() - start)
+
+    def eof_received(self):
+        return False
+
     def send_packet(self, packet):
         """
-        Send a packet over the socket connection
+        Send a packet over the socket connection, if the root mote is connected
+        (a command that couldn't be sent is sent again after ACK_TIMEOUT)
         :param packet: packet to send
         :return: None
         """
-        self.sock.send(bytes(packet.encode(), "utf-8") + b"\n")
+        if self.transport is not None:
+            self.transport.write(packet.encode())
+            if packet.type == OPEN_PACKET:
+                self.opens_sent.inc()
+            elif packet.type == CONFIG_FRAME:
+                self.configs_sent.inc()
 
-    def receive_packet(self):
+    def send_open(self, address, received):
         """
-        Gets packets from the socket connection and triggers the handling of those
+        Sends an OPEN command to the root mote, with a new command id, and waits for its acknowledgement
+        :param address: address of the mote whose valve must be opened
+        :param received: time (time.monotonic) of the reception of the reading that decided the OPEN
         :return: None
         """
-        data = self.sock.recv(1)
-        buf = b""
-        while data.decode("utf-8") != "\n":
-            buf += data
-            data = self.sock.recv(1)
-        packet = PackFactory.parse_packet(buf)
-        if packet is not None:
-            print("Received data: \tADDR = {}\tDATA = {}\tTIME = {}".format(packet.address, packet.data, packet.time))
-            self.handle_received_data(packet)
-            self.clear_timed_out_motes()
+        self.send_opens([address], received)
 
-    def clear_timed_out_motes(self):
+    def send_opens(self, addresses, received):
         """
-        Removes the nodes that did not send any data for 30 minutes
+        Sends OPEN commands to the root mote, in as few frames as possible, as far as the token bucket allows :
+        the other ones are sent later, by send_throttled
+        :param addresses: addresses of the motes whose valve must be opened
+        :param received: time (time.monotonic) of the reception of the readings that decided the OPEN
+        :return: None
         """
-        for mote, last_time in self.last_received.items():
-            if last_time < time.time() - 30*60:
-                if mote in self.values:
-                    del self.values[mote]
-                del self.last_received[mote]
+        for address in addresses:
+            if address not in self.throttled:
+                self.throttled[address] = received
+        self.send_throttled()
+        if self.throttled:
+            self.opens_throttled.inc(sum(1 for address in addresses if address in self.throttled))
 
+    def send_configs(self, addresses):
+        """
+        Pushes the local threshold to motes in CONFIG commands, sent by send_throttled after the OPEN commands
+        :param addresses: addresses of the motes
+        :return: None
+        """
+        for address in addresses:
+            self.configs[address] = None
+        self.send_throttled()
+
+    def refresh_configs(self):
+        """
+        Pushes the local threshold again to the motes every CONFIG_REFRESH seconds, on their next reading
+        :return: None
+        """
+        if self.local_threshold is not None and time.monotonic() >= self.configured_at + CONFIG_REFRESH:
+            self.configured.clear()
+            self.configured_at = time.monotonic()
+
+    def new_command_id(self):
+        """
+        :return: a command id not used by a command waiting for its acknowledgement, or recently delivered
+        """
+        while self.next_command_id in self.commands or self.next_command_id in self.delivered:
+            self.next_command_id = self.next_command_id % 0xFFFF + 1
+        command_id = self.next_command_id
+        self.next_command_id = self.next_command_id % 0xFFFF + 1
+        return command_id
+
+    def send_throttled(self):
+        """
+        Sends the delayed OPEN commands, then the delayed CONFIG commands, as many as the token bucket allows
+        (OPEN_RATE per second)
+        :return: None
+        """
+        now = time.monotonic()
+        self.tokens = min(OPEN_BURST, self.tokens + (now - self.refilled) * OPEN_RATE)
+        self.refilled = now
+        count = min(int(self.tokens), len(self.throttled) + len(self.configs))
+        if count == 0:
+            return
+        self.tokens -= count
+        nb_opens = min(count, len(self.throttled))
+        addresses, command_ids = [], []
+        for _ in range(nb_opens):
+            address, received = self.throttled.popitem(last=False)
+            command_id = self.new_command_id()
+            addresses.append(address)
+            command_ids.append(command_id)
+            self.commands[command_id] = [OpenPacket(address, command_id), 1, received]
+        configs = []
+        for _ in range(count - nb_opens):
+            address, _ = self.configs.popitem(last=False)
+            config_packet = ConfigPacket(address, self.local_threshold, self.new_command_id())
+            configs.append(config_packet)
+            self.commands[config_packet.command_id] = [config_packet, 1, None]
+        if self.transport is not None:
+            if addresses:
+                self.transport.write(encode_opens(command_ids, addresses))
+                self.opens_sent.inc(nb_opens)
+            if configs:
+                self.transport.write(encode_packets(configs))
+                self.configs_sent.inc(len(configs))
+
+    def command_failed(self, command_type, address):
+        """
+        Gives up a command : the valve of an OPEN is not open, and a CONFIG is pushed again on the next reading
+        :param command_type: type of the command
+        :param address: address of the mote of the command
+        :return: None
+        """
+        if command_type == OPEN_PACKET:
+            self.engine.valve_failed(mote_key(self.index, address))
+        else:
+            self.configured.discard(address)
+
+    def handle_ack(self, packet):
+        """
+        Handles the acknowledgement of an OPEN or CONFIG command by the root mote, sending the command again
+        if it failed
+        :param packet: received ack packet
+        :return: None
+        """
+        acks = self.acks.get(packet.status)
+        if acks is not None:
+            acks.inc()
+        command = self.commands.get(packet.command_id)
+        if command is not None and command[0].address == packet.address:
+            del self.commands[packet.command_id]
+            command_type = command[0].type
+        elif packet.status == ACK_NO_ROUTE and self.delivered.get(packet.command_id, (None, None))[1] == packet.address:
+            # Delivered command that later missed its route on the way (late acknowledgement)
+            command = None
+            command_type = self.delivered.pop(packet.command_id)[0]
+        else:
+            # Unknown command (forgotten, or acknowledged by an older root mote)
+            return
+        name = "OPEN" if command_type == OPEN_PACKET else "CONFIG"
+        if packet.status == ACK_DELIVERED:
+            self.delivered[packet.command_id] = (command_type, packet.address, time.monotonic())
+            if command_type == OPEN_PACKET:
+                OPEN_LATENCY.observe(time.monotonic() - command[2])
+            return
+        if packet.status == ACK_NO_ROUTE:
+            # The root mote already retried after asking for a fresh route
+            mote = mote_name(mote_key(self.index, packet.address))
+            logger.warning("%s message to node [%s] failed: no route", name, mote, extra={"mote": mote})
+            self.command_failed(command_type, packet.address)
+            return
+        self.retry_command(command)
+
+    def retry_command(self, command):
+        """
+        Sends again a command that failed or wasn't acknowledged, or gives it up after MAX_OPEN_ATTEMPTS attempts
+        :param command: [packet, attempts, reception time of the deciding reading] of the command,
+                        removed from the pending commands
+        :return: None
+        """
+        command_packet, attempts, received = command
+        if attempts >= MAX_OPEN_ATTEMPTS:
+            name = "OPEN" if command_packet.type == OPEN_PACKET else "CONFIG"
+            mote = mote_name(mote_key(self.index, command_packet.address))
+            logger.warning("%s message to node [%s] failed after %s attempts", name, mote, attempts,
+                           extra={"mote": mote, "attempts": attempts})
+            self.command_failed(command_packet.type, command_packet.address)
+            return
+        command_packet.time = round(time.time())
+        self.commands[command_packet.command_id] = [command_packet, attempts + 1, received]
+        self.send_packet(command_packet)
+
+    def handle_valve(self, packet):
+        """
+        Handles the report of a valve opened by its sensor mote itself : the engine sends no OPEN to it
+        before it closes, and a pending OPEN is not sent
+        :param packet: received valve packet
+        :return: None
+        """
+        mote = mote_key(self.index, packet.address)
+        self.local_opens.inc()
+        logger.info("Node [%s] opened its valve (slope %.2f per minute)", mote_name(mote), packet.slope / 100,
+                    extra={"mote": mote_name(mote), "slope": packet.slope / 100})
+        self.throttled.pop(packet.address, None)
+        self.engine.valve_opened(mote, round(time.time()))
+
+    def retry_unacked_commands(self):
+        """
+        Sends again the commands that have not been acknowledged for ACK_TIMEOUT seconds
+        (the frame may have been lost on the serial link), and forgets the commands delivered
+        DELIVERED_TIMEOUT seconds ago
+        :return: None
+        """
+        expired = time.monotonic() - DELIVERED_TIMEOUT
+        for command_id in [command_id for command_id, (_, _, delivery) in self.delivered.items() if delivery < expired]:
+            del self.delivered[command_id]
+        now = round(time.time())
+        for command_id, command in list(self.commands.items()):
+            if command[0].time + ACK_TIMEOUT < now:
+                del self.commands[command_id]
+                self.command_timeouts.inc()
+                self.retry_command(command)
+
+    def handle_frames(self, frames, lines):
+        """
+        Handles decoded frames and debug lines
+        :param frames: list of (type, payload) of the received frames
+        :param lines: list of the received debug lines
+        :return: None
+        """
+        for line in lines:
+            logger.info("Root %s: %s", self.index, line, extra={"root": self.index})
+        debug = logger.isEnabledFor(logging.DEBUG)
+        received = time.monotonic()
+        # All the readings of a chunk have the same reception time, a reading being read its age before
+        now = round(time.time())
+        addresses, values, ages, frames = parse_data(frames)
+        self.readings.inc(len(addresses))
+        base = self.index << 16
+        handle_reading = self.engine.handle_reading
+        opens = []
+        for address, value, age in zip(addresses, values, ages):
+            t = now - age
+            if debug:
+                logger.debug("Received data: \tADDR = %s\tDATA = %s\tTIME = %s", mote_name(base | address), value, t,
+                             extra={"mote": mote_name(base | address), "value": value, "time": t})
+            if handle_reading(base | address, t, value):
+                logger.info("Sending OPEN message to node [%s]", mote_name(base | address),
+                            extra={"mote": mote_name(base | address)})
+                opens.append(address)
+        if opens:
+            self.send_opens(opens, received)
+        self.engine.flush(received)
+        if self.local_threshold is not None and len(addresses):
+            new = set(addresses) - self.configured
+            if new:
+                self.configured |= new
+                self.send_configs(sorted(new))
+
+        for frame_type, payload in frames:
+            if frame_type == DEBUG_FRAME:
+                logger.info("Root %s: %s", self.index, str(payload, "utf-8", "replace").rstrip("\n"),
+                            extra={"root": self.index})
+                continue
+            if frame_type == STATS_FRAME:
+                if len(payload) != STATS_RECORD.size:
+                    # Valid CRC but not a STATS record
+                    self.frame_errors.inc()
+                    continue
+                dropped, max_buffered = STATS_RECORD.unpack_from(payload)
+                ROOT_DROPPED.labels(str(self.index)).inc(dropped)
+                ROOT_BUFFERED.labels(str(self.index)).value = max_buffered
+                logger.info("Root %s ingress buffer: %s readings dropped, at most %s buffered",
+                            self.index, dropped, max_buffered)
+                continue
+            packets = PackFactory.parse_frame(frame_type, payload)
+            payload.release()
+            for packet in packets:
+                if packet.type == ACK_FRAME:
+                    self.handle_ack(packet)
+                elif packet.type == VALVE_FRAME:
+                    self.handle_valve(packet)
+
+
+class Server:
+    """
+    Handles the connections to any number of root motes, each one the root of a separate network,
+    sharing a single decision engine
+    """
+
+    def __init__(self, roots, threshold=5, log=None, metrics_port=None, metrics_file=None, mote_metrics=False,
+                 shards=1, batch=False, detectors=(), local_threshold=None):
+        """
+        :param roots: list of the (ip, port) of the serial sockets of the root motes
+        :param threshold: minimum slope to trigger valves opening
+        :param log: path of the reading log, None to keep the readings only in memory
+                    (with several shards, each shard has its own log, LOG.SHARD)
+        :param metrics_port: port of the HTTP endpoint of the metrics on localhost, None for no endpoint
+        :param metrics_file: file where the metrics are written every METRICS_SNAPSHOT_PERIOD, None for no snapshots
+        :param mote_metrics: True to expose the last reception time and the rate of every mote (one line per mote,
+                             without shards only)
+        :param shards: number of worker processes making the decisions, 1 to make them in the server process
+        :param batch: True to make the decisions every DECISION_PERIOD for all the motes that sent readings,
+                      instead of on every reading
+        :param detectors: names of the detectors making the decisions on a pool of threads, instead of the slope
+                          on every reading (without shards only)
+        :param local_threshold: slope [centi-AQI per minute] over which the sensor motes open their valve
+                                themselves (LOCAL_DISABLED to disable it), None to leave their configuration
+        """
+        self.detectors = None
+        self.log = None
+        if shards > 1:
+            def shard_engine(index):
+                shard_logging(index)
+                engine = DecisionEngine(threshold, None if log is None else ReadingLog("{}.{}".format(log, index)),
+                                        batch=batch)
+                if engine.log is not None:
+                    logger.info("Shard %s: %s readings replayed from %s.%s",
+                                index, engine.warm(time.time()), log, index)
+                return engine
+
+            self.engine = ShardedEngine(shards, shard_engine, TICK_PERIOD, DECISION_PERIOD)
+        else:
+            if log is not None:
+                self.log = ReadingLog(log)
+            self.engine = DecisionEngine(threshold, self.log, batch=batch, detectors=detectors)
+            if detectors:
+                self.detectors = DetectorPool(self.engine.detectors, self.engine.store)
+            if self.log is not None:
+                logger.info("%s readings replayed from %s", self.engine.warm(time.time()), log)
+        self.connections = [RootConnection(self.engine, index, ip, port, local_threshold)
+                            for index, (ip, port) in enumerate(roots)]
+        self.metrics_port = metrics_port
+        self.metrics_file = metrics_file
+        self.register_metrics(mote_metrics and shards == 1)
+
+    def register_metrics(self, mote_metrics):
+        """
+        Registers the metrics collected from the state of the server when they are exposed
+        :param mote_metrics: True to register the metrics of every mote
+        :return: None
+        """
+        engine = self.engine
+        REGISTRY.gauge("server_motes", "Motes followed by the server", collect=lambda: [((), engine.nb_motes())])
+        REGISTRY.counter("server_duplicates_total", "Duplicate readings dropped",
+                         collect=lambda: [((), engine.duplicates)])
+        REGISTRY.counter("server_motes_expired_total", "Motes forgotten after MOTE_TIMEOUT without data",
+                         collect=lambda: [((), engine.evicted)])
+        REGISTRY.gauge("server_root_connected", "1 if the root mote is connected", ("root",),
+                       collect=lambda: [((str(c.index),), int(c.transport is not None)) for c in self.connections])
+        REGISTRY.gauge("server_pending_commands", "Commands waiting for their acknowledgement", ("root",),
+                       collect=lambda: [((str(c.index),), len(c.commands)) for c in self.connections])
+        REGISTRY.gauge("server_throttled_commands", "Commands waiting for the rate limit of the root mote",
+                       ("root",), collect=lambda: [((str(c.index),), len(c.throttled) + len(c.configs))
+                                                   for c in self.connections])
+        REGISTRY.counter("server_open_suppressed_total", "OPEN decisions not sent, the valve being already open",
+                         collect=lambda: [((), engine.suppressed)])
+        REGISTRY.gauge("server_buffered_bytes", "Received bytes not decoded yet (incomplete frame)", ("root",),
+                       collect=lambda: [((str(c.index),), c.decoder.end - c.decoder.start) for c in self.connections])
+        if isinstance(engine, ShardedEngine):
+            REGISTRY.counter("server_shard_dropped_total", "Readings dropped, the inbox of their shard being full",
+                             collect=lambda: [((), engine.dropped)])
+        if not mote_metrics:
+            return
+        store = engine.store
+
+        def rates():
+            samples = []
+            for key, slot in store.index.items():
+                count = store.count[slot]
+                first = store.times[slot * store.window + store.first[slot]]
+                last = store.last(slot)
+                if count > 1 and last[0] > first:
+                    samples.append(((mote_name(key),), round(60 * (count - 1) / (last[0] - first), 3)))
+            return samples
+
+        REGISTRY.gauge("server_mote_last_seen_seconds", "Last reception time of a mote", ("mote",),
+                       collect=lambda: [((mote_name(key),), store.last_received[slot])
+                                        for key, slot in store.index.items()])
+        REGISTRY.gauge("server_mote_readings_per_minute", "Rate of the readings of a mote over its window", ("mote",),
+                       collect=rates)
+
+    def on_open(self, mote, received):
+        """
+        Sends an OPEN command decided by a shard or in batch mode
+        :param mote: key of the mote whose valve must be opened
+        :param received: reception time (time.monotonic) of the reading that decided the OPEN
+        :return: None
+        """
+        logger.info("Sending OPEN message to node [%s]", mote_name(mote), extra={"mote": mote_name(mote)})
+        self.connections[mote >> 16].send_open(mote & 0xFFFF, received)
+
+    def on_alarm(self, mote, received):
+        """
+        Opens the valve of a mote found anomalous by a detector, unless it is already open
+        :param mote: key of the mote
+        :param received: reception time (time.monotonic) of the oldest reading evaluated by the detector
+        :return: None
+        """
+        slot = self.engine.store.index.get(mote)
+        if slot is not None and self.engine.open_valve(slot, round(time.time())):
+            self.on_open(mote, received)
 
-def least_squares_slope(tuples):
+    async def tick(self):
+        """
+        Periodic maintenance of the server
+        :return: None
+        """
+        while True:
+            await asyncio.sleep(TICK_PERIOD)
+            for connection in self.connections:
+                connection.retry_unacked_commands()
+                connection.refresh_configs()
+                if connection.throttled or connection.configs:
+                    connection.send_throttled()
+            evicted = self.engine.expire_motes(time.time())
+            if evicted:
+                logger.info("%s inactive motes forgotten (%s since the start)", evicted, self.engine.evicted)
+            if self.log is not None:
+                self.log.flush()
+
+    async def decide(self):
+        """
+        Batch mode : makes the decisions every DECISION_PERIOD
+        :return: None
+        """
+        while True:
+            await asyncio.sleep(DECISION_PERIOD)
+            for mote, received in self.engine.decide(round(time.time())):
+                self.on_open(mote, received)
+
+    async def run(self):
+        """
+        Runs the server until it is stopped (Ctrl-C or SIGTERM)
+        :return: None
+        """
+        # Stopped like with Ctrl-C, by cancelling the task in the event loop, not by an exception raised
+        # anywhere (in the middle of the queue of the log, for example)
+        asyncio.get_running_loop().add_signal_handler(signal.SIGTERM, asyncio.current_task().cancel)
+        tasks = [self.tick()] + [connection.run() for connection in self.connections]
+        if isinstance(self.engine, ShardedEngine):
+            tasks.append(self.engine.poll(self.on_open))
+        elif self.engine.batch:
+            tasks.append(self.decide())
+        elif self.detectors is not None:
+            tasks.append(self.detectors.run(self.on_alarm))
+        if self.metrics_port is not None:
+            await REGISTRY.serve(self.metrics_port)
+            logger.info("Metrics on http://127.0.0.1:%s/metrics", self.metrics_port)
+        if self.metrics_file is not None:
+            tasks.append(REGISTRY.snapshot(self.metrics_file, METRICS_SNAPSHOT_PERIOD))
+        await asyncio.gather(*tasks)
+
+
+def parse_root(root):
     """
-    Computes the slope of the least square regression of the tapple list given as parameter
-    :param tuples: the (x, y) data
-    :return: the slope
+    :param root: serial socket of a root mote, IP:PORT
+    :return: the (ip, port) of the socket
     """
-    n = len(tuples)
-    x = [t[0] for t in tuples]
-    y = [t[1] for t in tuples]
-    sum_x, sum_y = sum(x), sum(y)
-    sum_xy, sum_xx = 0, 0
+    ip, _, port = root.rpartition(":")
+    return ip.strip("[]"), int(port)
 
-    for index in range(n):
-        sum_xy += x[index] * y[index]
-        sum_xx += x[index] * x[index]
-    slope = (sum_x * sum_y - n * sum_xy) / (sum_x * sum_x - n * sum_xx)
 
-    return (int(slope * 100)) / 100
+def parse_local_threshold(threshold):
+    """
+    :param threshold: slope [AQI per minute] over which the sensor motes open their valve themselves, or "off"
+    :return: the threshold of the CONFIG commands [centi-AQI per minute]
+    """
+    if threshold == "off":
+        return LOCAL_DISABLED
+    return max(0, min(LOCAL_DISABLED - 1, round(float(threshold) * 100)))
 
 
 if __name__ == '__main__':
-    threshold = 0
+    parser = argparse.ArgumentParser(description="Server of the irrigation networks")
+    parser.add_argument("roots", nargs="+", type=parse_root, metavar="IP:PORT",
+                        help="serial socket (server) of a root mote, one per network")
+    parser.add_argument("-t", "--threshold", type=float, default=0,
+                        help="minimum slope to trigger valves opening")
+    parser.add_argument("-l", "--log", help="reading log, replayed at startup to warm the windows of the motes")
+    parser.add_argument("--log-level", default="INFO", choices=("DEBUG", "INFO", "WARNING", "ERROR"),
+                        help="DEBUG to print every received reading")
+    parser.add_argument("--log-file", help="file where the log is written as JSON lines, rotated, "
+                                           "LOG_FILE.SHARD for the shards (stderr otherwise)")
+    parser.add_argument("--log-json", action="store_true", help="write the log to stderr as JSON lines")
+    parser.add_argument("--metrics-port", type=int, help="port of the HTTP endpoint of the metrics, on localhost")
+    parser.add_argument("--metrics-file", help="file where the metrics are written every minute")
+    parser.add_argument("--mote-metrics", action="store_true", help="expose the metrics of every mote")
+    parser.add_argument("--shards", type=int, default=1,
+                        help="number of worker processes making the decisions (about one per core)")
+    parser.add_argument("--batch", action="store_true",
+                        help="make the decisions every DECISION_PERIOD instead of on every reading")
+    parser.add_argument("--detectors", type=lambda names: names.split(","), default=[],
+                        help="detectors making the decisions on a pool of threads, among " + ",".join(DETECTORS) +
+                             " (ewma and cusum ignore the threshold, see detectors.py)")
+    parser.add_argument("--local-threshold", type=parse_local_threshold,
+                        help="slope [AQI per minute] over which the sensor motes open their valve themselves, "
+                             "pushed to them in CONFIG commands ('off' to leave the valves to the server)")
+    args = parser.parse_args()
+    for name in args.detectors:
+        if name not in DETECTORS:
+            parser.error("unknown detector: " + name)
+    if args.detectors and (args.batch or args.shards > 1):
+        parser.error("the detectors replace the batch mode, and do not run in shards")
+
+    handler, listener = setup_logging(args.log_level, args.log_file, args.log_json)
+    REGISTRY.counter("server_log_dropped_total", "Log records dropped, the queue of the writer being full",
+                     collect=lambda: [((), handler.dropped)])
+    server = Server(args.roots, args.threshold, args.log, args.metrics_port, args.metrics_file, args.mote_metrics,
+                    args.shards, args.batch, args.detectors, args.local_threshold)
     try:
-        router_ip = sys.argv[1]
-        router_port = int(sys.argv[2])
-    except Exception:
-        print("The server takes at least 2 parameters:")
-        print("[Mandatory]\tRouter IP [string] (IPv6 address)")
-        print("[Mandatory]\tRouter PORT [int] (UDP port)")
-        print("[Optional]\tSlope threshold [float] (minimum slope to trigger valves opening)")
-        exit(-1)
-
-    if len(sys.argv) > 3:
-        # This threshold corresponds to the slope threshold
-        threshold = sys.argv[3]
-
-    server = Server(int(threshold))
-    i = 0
-    while True:
-        server.receive_packet()
+        asyncio.run(server.run())
+    except (KeyboardInterrupt, asyncio.CancelledError):
+        pass
+    finally:
+        if server.log is not None:
+            server.log.close()
+        if isinstance(server.engine, ShardedEngine):
+            server.engine.close()
+        if server.detectors is not None:
+            server.detectors.close()
+        listener.stop()
@@ -0,0 +1,310 @@
+"""
+Decision engine sharded across worker processes, so that the decisions of a large fleet use several cores.
+The motes are assigned to the shards by a hash of their key, each shard owning the state of its motes :
+- the I/O front end (the asyncio server) pushes the readings of a shard in its inbox;
+- the worker process of the shard runs a DecisionEngine on them, and pushes its OPEN decisions in its outbox;
+- the front end polls the outboxes, and sends the OPEN commands on the connection of the root of the mote;
+- the state of the valves known by the front end (OPEN command failed, valve opened by its mote) is pushed
+  in the inbox of the shard of the mote as control records, applied by the shard to its engine.
+Inboxes and outboxes are single-producer single-consumer rings in shared memory.
+"""
+
+from multiprocessing import shared_memory
+import asyncio
+import multiprocessing
+import os
+import struct
+import time
+
+# Readings : key of the mote, reception time, value, reception time of the chunk (time.monotonic of the front end),
+# kind of the record (a reading, or a control record with the key of the mote and the current time)
+READING = struct.Struct("<IIHdB")
+
+# Kinds of the records of the inboxes
+READING_RECORD = 0
+VALVE_FAILED_RECORD = 1
+VALVE_OPENED_RECORD = 2
+# Decisions : key of the mote, reception time of the chunk of the reading that decided the OPEN
+DECISION = struct.Struct("<Id")
+
+# Number of records of the inbox and of the outbox of a shard
+INBOX_SIZE = 1 << 16
+OUTBOX_SIZE = 1 << 12
+
+# Time [sec] a worker waits when its inbox is empty, and between two polls of the outboxes by the front end
+SHARD_POLL_PERIOD = 0.001
+
+# Statistics of a shard, in shared memory : motes, duplicates, expired motes, handled readings,
+# OPEN decisions not sent (valve already open)
+STATS = ("motes", "duplicates", "evicted", "readings", "suppressed")
+
+# Multiplier of the hash of the keys (Knuth), so that consecutive addresses are spread over the shards
+HASH_MULTIPLIER = 2654435761
+
+
+def shard_of(key, nb_shards):
+    """
+    :param key: key of a mote
+    :param nb_shards: number of shards
+    :return: the shard owning the mote
+    """
+    return ((key * HASH_MULTIPLIER) & 0xFFFFFFFF) * nb_shards >> 32
+
+
+class SharedRing:
+    """
+    Single-producer single-consumer ring of fixed-size records in shared memory.
+    The header holds the number of records read (written by the consumer only) and the number of records
+    written (written by the producer only, after the records).
+    """
+
+    HEADER = struct.Struct("<QQ")
+
+    def __init__(self, record, capacity):
+        """
+        :param record: struct.Struct of the records
+        :param capacity: number of records of the ring
+        """
+        self.record = record
+        self.capacity = capacity
+        self.memory = shared_memory.SharedMemory(create=True, size=self.HEADER.size + capacity * record.size)
+        self.buffer = self.memory.buf
+        self.HEADER.pack_into(self.buffer, 0, 0, 0)
+
+    def push(self, records, *extra):
+        """
+        Writes records in the ring (producer)
+        :param records: list of the tuples of the records
+        :param extra: last fields, the same for all the records
+        :return: number of records written, less than given if the ring is full
+        """
+        head, tail = self.HEADER.unpack_from(self.buffer, 0)
+        count = min(len(records), self.capacity - (tail - head))
+        pack_into, size, buffer = self.record.pack_into, self.record.size, self.buffer
+        position = tail % self.capacity
+        offset = self.HEADER.size + position * size
+        for i in range(count):
+            pack_into(buffer, offset, *records[i], *extra)
+            position += 1
+            offset += size
+            if position == self.capacity:
+                position = 0
+                offset = self.HEADER.size
+        struct.pack_into("<Q", buffer, 8, tail + count)
+        return count
+
+    def pop(self):
+        """
+        Reads all the records written in the ring (consumer)
+        :return: list of the tuples of the records
+        """
+        head, tail = self.HEADER.unpack_from(self.buffer, 0)
+        if head == tail:
+            return []
+        size = self.record.size
+        start, end = head % self.capacity, tail % self.capacity
+        data = self.HEADER.size
+        if start < end:
+            records = list(self.record.iter_unpack(self.buffer[data + start * size:data + end * size]))
+        else:
+            records = list(self.record.iter_unpack(self.buffer[data + start * size:data + self.capacity * size]))
+            records += self.record.iter_unpack(self.buffer[data:data + end * size])
+        struct.pack_into("<Q", self.buffer, 0, tail)
+        return records
+
+    def close(self):
+        self.buffer.release()
+        self.memory.close()
+        self.memory.unlink()
+
+
+def run_shard(index, engine_factory, tick, decision_period, inbox, outbox, stats, stop):
+    """
+    Main loop of the worker process of a shard
+    :param index: index of the shard
+    :param engine_factory: function creating the DecisionEngine of the shard
+    :param tick: period [sec] of the expiry of the motes
+    :param decision_period: period [sec] of the decisions if the engine is in batch mode
+    :param inbox: ring of the readings of the shard, inherited from the front end
+    :param outbox: ring of the decisions of the shard, inherited from the front end
+    :param stats: shared array of the statistics of the shards
+    :param stop: event set to stop the worker
+    :return: None
+    """
+    parent = os.getppid()
+    engine = engine_factory(index)
+    base = index * len(STATS)
+    readings = 0
+    next_tick = next_decision = time.monotonic() + tick
+    while not stop.is_set():
+        records = inbox.pop()
+        decisions = []
+        for key, t, value, received, kind in records:
+            if kind == READING_RECORD:
+                if engine.handle_reading(key, t, value):
+                    decisions.append((key, received))
+                readings += 1
+            elif kind == VALVE_FAILED_RECORD:
+                engine.valve_failed(key)
+            else:
+                engine.valve_opened(key, t)
+        if engine.batch:
+            if records:
+                # Oldest reception time of the popped readings
+                engine.flush(records[0][3])
+            if time.monotonic() >= next_decision:
+                decisions += engine.decide(round(time.time()))
+                next_decision += decision_period
+        while decisions:
+            decisions = decisions[outbox.push(decisions):]
+            if decisions:
+                time.sleep(SHARD_POLL_PERIOD)
+        if time.monotonic() >= next_tick:
+            engine.expire_motes(time.time())
+            if engine.log is not None:
+                engine.log.flush()
+            next_tick += tick
+            stats[base:base + len(STATS)] = [engine.nb_motes(), engine.duplicates, engine.evicted, readings,
+                                              engine.suppressed]
+            if os.getppid() != parent:
+                # Front end killed without closing the engine
+                break
+        if not records:
+            time.sleep(SHARD_POLL_PERIOD)
+    if engine.log is not None:
+        engine.log.close()
+
+
+class ShardedEngine:
+    """
+    Front end of the decision engine sharded across worker processes, used by the root connections
+    as the DecisionEngine : the decisions are given later to a callback instead of being returned.
+    """
+
+    def __init__(self, nb_shards, engine_factory, tick, decision_period=None):
+        """
+        :param nb_shards: number of worker processes
+        :param engine_factory: function creating the DecisionEngine of a shard, given the index of the shard
+                               (the workers are forked : the arguments are inherited, not pickled)
+        :param tick: period [sec] of the expiry of the motes
+        :param decision_period: period [sec] of the decisions if the engines are in batch mode, tick if None
+        """
+        context = multiprocessing.get_context("fork")
+        self.nb_shards = nb_shards
+        self.inboxes = [SharedRing(READING, INBOX_SIZE) for _ in range(nb_shards)]
+        self.outboxes = [SharedRing(DECISION, OUTBOX_SIZE) for _ in range(nb_shards)]
+        self.stats = context.Array("q", nb_shards * len(STATS), lock=False)
+        self.stop = context.Event()
+        self.pending = [[] for _ in range(nb_shards)]
+        self.dropped = 0
+        self.workers = [context.Process(target=run_shard, name="shard-{}".format(index), daemon=True,
+                                        args=(index, engine_factory, tick, decision_period or tick,
+                                              self.inboxes[index],
+                                              self.outboxes[index], self.stats, self.stop))
+                        for index in range(nb_shards)]
+        for worker in self.workers:
+            worker.start()
+
+    def handle_reading(self, mote, t, value):
+        """
+        Queues a reading for the shard of its mote
+        :param mote: key of the mote that sent the reading
+        :param t: reception time of the reading
+        :param value: the reading
+        :return: False, the decision is given later to the callback of poll
+        """
+        self.pending[shard_of(mote, self.nb_shards)].append((mote, t, value))
+        return False
+
+    def flush(self, received):
+        """
+        Pushes the queued readings to the inboxes of the shards, dropping them if an inbox is full
+        :param received: reception time (time.monotonic) of the chunk of the readings
+        :return: None
+        """
+        for shard, records in enumerate(self.pending):
+            if records:
+                self.dropped += len(records) - self.inboxes[shard].push(records, received, READING_RECORD)
+                records.clear()
+
+    def control(self, mote, kind, t=0):
+        """
+        Pushes a control record to the inbox of the shard of a mote
+        :param mote: key of the mote
+        :param kind: kind of the record
+        :param t: current time
+        :return: None
+        """
+        if self.inboxes[shard_of(mote, self.nb_shards)].push([(mote, t, 0)], time.monotonic(), kind) == 0:
+            self.dropped += 1
+
+    async def poll(self, on_open):
+        """
+        Gives the decisions of the shards to a callback, until the engine is closed
+        :param on_open: function called with the key of the mote and the reception time of the chunk of the
+                        reading, for each OPEN decision
+        :return: None
+        """
+        while not self.stop.is_set():
+            for outbox in self.outboxes:
+                for mote, received in outbox.pop():
+                    on_open(mote, received)
+            await asyncio.sleep(SHARD_POLL_PERIOD)
+
+    def stat(self, name):
+        """
+        :param name: name of a statistic
+        :return: the sum of the statistic over the shards, as of their last tick
+        """
+        i = STATS.index(name)
+        return sum(self.stats[shard * len(STATS) + i] for shard in range(self.nb_shards))
+
+    def nb_motes(self):
+        return self.stat("motes")
+
+    @property
+    def duplicates(self):
+        return self.stat("duplicates")
+
+    @property
+    def evicted(self):
+        return self.stat("evicted")
+
+    @property
+    def suppressed(self):
+        return self.stat("suppressed")
+
+    def valve_failed(self, mote):
+        """
+        Forgets in the shard of a mote that its valve is open, its OPEN command having failed
+        :param mote: key of the mote
+        :return: None
+        """
+        self.control(mote, VALVE_FAILED_RECORD)
+
+    def valve_opened(self, mote, t):
+        """
+        Records in the shard of a mote that the mote opened its valve itself
+        :param mote: key of the mote
+        :param t: current time
+        :return: None
+        """
+        self.control(mote, VALVE_OPENED_RECORD, t)
+
+    def expire_motes(self, now):
+        """
+        The shards expire their motes themselves
+        :return: 0
+        """
+        return 0
+
+    def close(self):
+        """
+        Stops the workers and frees the shared memory
+        :return: None
+        """
+        self.stop.set()
+        for worker in self.workers:
+            worker.join()
+        for ring in self.inboxes + self.outboxes:
+            ring.close()
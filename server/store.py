@@ -0,0 +1,226 @@
+from array import array
+import threading
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+# Initial number of motes the store has room for, doubled when it is full
+INITIAL_CAPACITY = 1024
+
+# Minimum number of slopes computed at once for numpy to be faster than the loop (conversion overhead)
+NUMPY_MIN_SLOTS = 64
+
+
+class MoteStore:
+    """
+    Last values of every mote, stored in columns instead of Python objects.
+    Each mote has a slot, given by a key -> slot table, freed slots being reused. For each slot :
+    - a circular buffer of `window` times (uint32, seconds) and values (uint16), in the columns times and values,
+      the values older than `horizon` seconds being evicted too, so that the regression covers the same time
+      whatever the sampling of the mote (send-on-delta);
+    - the index of its oldest value, its number of values and its last reception time;
+    - the time until which its valve is open, as far as the server knows (0 if it never opened it);
+    - the running sums of the least squares regression, on times relative to its oldest value (origin),
+      so that adding a value and evicting the oldest one are done in constant time.
+    The columns may be read by the threads of the detectors while the server adds values : the changes of a slot
+    (new mote, added and evicted values with the sums), the reads of its values and sums (slope, steep, detectors)
+    and the growth of the columns (a column exporting its buffer can't grow) are serialised by a lock, so that
+    a reader never sees a half-updated slot.
+    """
+
+    def __init__(self, window, capacity=INITIAL_CAPACITY, horizon=None):
+        self.window = window
+        self.horizon = horizon
+        self.capacity = 0
+        self.index = {}  # key of a mote -> slot
+        self.keys = []   # slot -> key of the mote, None if the slot is free
+        self.free = []   # free slots
+        self.times = array("I")
+        self.values = array("H")
+        self.first = array("H")
+        self.count = array("H")
+        self.origin = array("I")
+        self.last_received = array("I")
+        self.open_until = array("I")
+        self.sum_x = array("q")
+        self.sum_y = array("q")
+        self.sum_xx = array("q")
+        self.sum_xy = array("q")
+        self.lock = threading.Lock()
+        self._grow(capacity)
+
+    def __len__(self):
+        return len(self.index)
+
+    def __contains__(self, key):
+        return key in self.index
+
+    def _grow(self, capacity):
+        """
+        Adds room for more motes
+        :param capacity: new number of slots
+        :return: None
+        """
+        added = capacity - self.capacity
+        with self.lock:
+            for column in (self.times, self.values):
+                column.extend(array(column.typecode, [0]) * (added * self.window))
+            for column in (self.first, self.count, self.origin, self.last_received, self.open_until,
+                           self.sum_x, self.sum_y, self.sum_xx, self.sum_xy):
+                column.extend(array(column.typecode, [0]) * added)
+        self.keys.extend([None] * added)
+        self.free.extend(range(capacity - 1, self.capacity - 1, -1))
+        self.capacity = capacity
+
+    def slot(self, key):
+        """
+        Gives the slot of a mote, allocating an empty one for a new mote
+        :param key: key of the mote
+        :return: the slot of the mote
+        """
+        slot = self.index.get(key)
+        if slot is None:
+            if not self.free:
+                self._grow(2 * self.capacity)
+            slot = self.free.pop()
+            self.index[key] = slot
+            with self.lock:
+                self.keys[slot] = key
+                self.first[slot] = self.count[slot] = self.open_until[slot] = 0
+                self.sum_x[slot] = self.sum_y[slot] = self.sum_xx[slot] = self.sum_xy[slot] = 0
+        return slot
+
+    def remove(self, key):
+        """
+        Removes a mote, freeing its slot
+        :param key: key of the mote
+        :return: None
+        """
+        slot = self.index.pop(key, None)
+        if slot is not None:
+            self.keys[slot] = None
+            self.free.append(slot)
+
+    def last(self, slot):
+        """
+        :param slot: slot of a mote
+        :return: the (time, value) of the last value of the mote, None if it has no value
+        """
+        count = self.count[slot]
+        if count == 0:
+            return None
+        i = slot * self.window + (self.first[slot] + count - 1) % self.window
+        return self.times[i], self.values[i]
+
+    def add(self, slot, t, value):
+        """
+        Adds a value to a mote, evicting its oldest one if its window is full, and the ones older than the horizon
+        :param slot: slot of the mote
+        :param t: time of the value
+        :param value: the value
+        :return: None
+        """
+        window = self.window
+        with self.lock:
+            count = self.count[slot]
+            if count == window:
+                self.evict(slot)
+                count -= 1
+            if count == 0:
+                self.origin[slot] = t
+            i = slot * window + (self.first[slot] + count) % window
+            self.times[i] = t
+            self.values[i] = value
+            self.count[slot] = count + 1
+            x = t - self.origin[slot]
+            self.sum_x[slot] += x
+            self.sum_y[slot] += value
+            self.sum_xx[slot] += x * x
+            self.sum_xy[slot] += x * value
+            if self.horizon is not None:
+                limit = t - self.horizon
+                while self.count[slot] > 1 and self.times[slot * window + self.first[slot]] < limit:
+                    self.evict(slot)
+
+    def evict(self, slot):
+        """
+        Removes the oldest value of a mote, and moves its time origin to its new oldest value (the lock held)
+        :param slot: slot of the mote
+        :return: None
+        """
+        first = self.first[slot]
+        i = slot * self.window + first
+        x = self.times[i] - self.origin[slot]
+        value = self.values[i]
+        self.sum_x[slot] -= x
+        self.sum_y[slot] -= value
+        self.sum_xx[slot] -= x * x
+        self.sum_xy[slot] -= x * value
+        first = (first + 1) % self.window
+        self.first[slot] = first
+        self.count[slot] -= 1
+        if self.count[slot] > 0:
+            self.rebase(slot, self.times[slot * self.window + first])
+
+    def rebase(self, slot, origin):
+        """
+        Moves the time origin of the sums of a mote : x becomes x - d (the lock held)
+        :param slot: slot of the mote
+        :param origin: the new time origin
+        :return: None
+        """
+        d = origin - self.origin[slot]
+        n = self.count[slot]
+        sum_x = self.sum_x[slot]
+        self.sum_xx[slot] -= 2 * d * sum_x - n * d * d
+        self.sum_xy[slot] -= d * self.sum_y[slot]
+        self.sum_x[slot] = sum_x - n * d
+        self.origin[slot] = origin
+
+    def slope(self, slot):
+        """
+        Computes the slope of the least square regression of the values of a mote
+        :param slot: slot of the mote
+        :return: the slope, 0 if all the values have the same time
+        """
+        with self.lock:
+            n = self.count[slot]
+            sum_x, sum_y, sum_xx, sum_xy = self.sum_x[slot], self.sum_y[slot], self.sum_xx[slot], self.sum_xy[slot]
+        denominator = n * sum_xx - sum_x * sum_x
+        if denominator == 0:
+            return 0.0
+        return (n * sum_xy - sum_x * sum_y) / denominator
+
+    def steep(self, slots, threshold):
+        """
+        Computes the slopes of the least square regression of the values of several motes at once,
+        in a vectorised pass over the columns of the sums with numpy when it is installed
+        :param slots: list of the slots of the motes
+        :param threshold: minimum slope, compared to the slopes truncated to 2 decimals (as the server does)
+        :return: list of the slots whose slope is above the threshold
+        """
+        if numpy is None or len(slots) < NUMPY_MIN_SLOTS:
+            count, sum_x, sum_y, sum_xx, sum_xy = self.count, self.sum_x, self.sum_y, self.sum_xx, self.sum_xy
+            steep = []
+            with self.lock:
+                for slot in slots:
+                    n = count[slot]
+                    x = sum_x[slot]
+                    denominator = n * sum_xx[slot] - x * x
+                    if denominator and int((n * sum_xy[slot] - x * sum_y[slot]) / denominator * 100) / 100 > threshold:
+                        steep.append(slot)
+            return steep
+        index = numpy.array(slots, dtype=numpy.intp)
+        # The views on the columns are released before the lock, the columns can be grown again
+        with self.lock:
+            n = numpy.frombuffer(self.count, numpy.uint16)[index].astype(numpy.float64)
+            x = numpy.frombuffer(self.sum_x, numpy.int64)[index].astype(numpy.float64)
+            y = numpy.frombuffer(self.sum_y, numpy.int64)[index].astype(numpy.float64)
+            xx = numpy.frombuffer(self.sum_xx, numpy.int64)[index].astype(numpy.float64)
+            xy = numpy.frombuffer(self.sum_xy, numpy.int64)[index].astype(numpy.float64)
+        denominator = n * xx - x * x
+        valid = denominator != 0
+        slopes = (n * xy - x * y) / numpy.where(valid, denominator, 1.0)
+        return index[valid & (numpy.trunc(slopes * 100) / 100 > threshold)].tolist()